@@ -0,0 +1,173 @@
+// *****************************************************************************
+//
+// Asynchronous output sink. Implementation.
+//
+// *****************************************************************************
+
+#include <chrono>
+#include <unistd.h>   // write
+#include "AsyncLog.hpp"
+
+namespace HM
+{
+
+// maximum size of a batch (written with a single 'write' call)
+static const std::size_t max_batch_size = 64*1024 ;
+
+// *****************************************************************************
+//  AsyncLog
+
+AsyncLog & AsyncLog::instance()
+{
+   static AsyncLog sink ;
+   return sink ;
+}
+// -----------------------------------------------------------------------------
+
+AsyncLog::AsyncLog()
+:  head( new Node ),
+   pushed( 0 ),
+   written( 0 ),
+   sleeping( false ),
+   stop( false )
+{
+   tail   = head.load();
+   writer = std::thread( &AsyncLog::write_loop, this );
+}
+// -----------------------------------------------------------------------------
+// write the pending messages and stop the writer
+
+AsyncLog::~AsyncLog()
+{
+   {
+      std::unique_lock<std::mutex> lock( mtx );
+      stop = true ;
+   }
+   wake_cv.notify_one();
+   writer.join();
+
+   // delete the stub (and any message pushed after the writer stopped)
+   while ( tail != nullptr )
+   {
+      Node * next = tail->next.load();
+      delete tail ;
+      tail = next ;
+   }
+}
+// -----------------------------------------------------------------------------
+// queue a message: a single exchange on 'head', plus a notification only if
+// the writer is sleeping
+
+void AsyncLog::push( std::string && text )
+{
+   Node * n = new Node ;
+   n->text = std::move( text );
+
+   pushed.fetch_add( 1, std::memory_order_relaxed );
+   Node * prev = head.exchange( n, std::memory_order_acq_rel );
+   prev->next.store( n, std::memory_order_seq_cst );
+
+   // (the writer sets 'sleeping' and then checks the queue again)
+   if ( sleeping.load( std::memory_order_seq_cst ) && sleeping.exchange( false ) )
+   {
+      std::unique_lock<std::mutex> lock( mtx );
+      wake_cv.notify_one();
+   }
+}
+// -----------------------------------------------------------------------------
+
+void AsyncLog::flush()
+{
+   const unsigned long target = pushed.load();
+   std::unique_lock<std::mutex> lock( mtx );
+   while ( written.load() < target )
+   {
+      sleeping.store( false );
+      wake_cv.notify_one();
+      flush_cv.wait_for( lock, std::chrono::milliseconds( 10 ) );
+   }
+}
+// -----------------------------------------------------------------------------
+// take the next message node out of the queue (only called by the writer),
+// the node must be deleted after use
+
+AsyncLog::Node * AsyncLog::pop()
+{
+   Node * next = tail->next.load( std::memory_order_seq_cst );
+   if ( next == nullptr )
+      return nullptr ;   // empty (or a producer is just linking its node)
+
+   delete tail ;         // the old stub, already consumed
+   tail = next ;         // 'next' becomes the stub, its text is returned
+   return next ;
+}
+// -----------------------------------------------------------------------------
+
+void AsyncLog::write_loop()
+{
+   std::string batch ;
+   batch.reserve( max_batch_size );
+
+   for( ;; )
+   {
+      // gather as many messages as possible in a single batch
+      unsigned long num = 0 ;
+      while ( batch.size() < max_batch_size )
+      {
+         Node * n = pop();
+         if ( n == nullptr )
+            break ;
+         batch += n->text ;
+         std::string().swap( n->text );   // release memory now, the stub stays
+         num++ ;
+      }
+
+      if ( 0 < num )
+      {
+         const char * p    = batch.data();
+         std::size_t  size = batch.size();
+         while ( 0 < size )
+         {
+            const ssize_t w = ::write( 1, p, size );
+            if ( w <= 0 )
+               break ;   // output closed: messages are discarded
+            p    += w ;
+            size -= std::size_t( w );
+         }
+         batch.clear();
+
+         std::unique_lock<std::mutex> lock( mtx );
+         written.fetch_add( num );
+         flush_cv.notify_all();
+         continue ;
+      }
+
+      // the queue looks empty: announce sleeping, then check again
+      sleeping.store( true, std::memory_order_seq_cst );
+      if ( tail->next.load( std::memory_order_seq_cst ) != nullptr )
+      {
+         sleeping.store( false );
+         continue ;
+      }
+
+      std::unique_lock<std::mutex> lock( mtx );
+      if ( stop )
+         break ;
+      wake_cv.wait_for( lock, std::chrono::milliseconds( 100 ),
+                        [this] { return ! sleeping.load() || stop ; } );
+      sleeping.store( false );
+   }
+}
+
+// *****************************************************************************
+//  LogLine
+
+LogLine::~LogLine()
+{
+   if ( ! active )
+      return ;
+   os << '\n' ;
+   AsyncLog::instance().push( os.str() );
+}
+
+} // namespace HM end
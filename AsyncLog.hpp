@@ -0,0 +1,140 @@
+// *****************************************************************************
+//
+// Asynchronous output sink. Declarations.
+//
+// Messages are formatted by the calling thread and queued in a lock-free
+// multiple producers, single consumer queue. A background writer thread
+// takes them out in batches and writes each batch to the standard output
+// with a single 'write' call. Threads never block on the output (in
+// particular, not while holding a monitor), and the messages of different
+// threads are never mixed.
+//
+// usage:
+//    async_log() << "Cliente" << i << ": Buenos dias!" ;
+//
+// every 'async_log()' expression queues one line (a new line is appended
+// when the expression ends). 'async_log( false )' returns a null line, which
+// ignores everything written on it.
+//
+// *****************************************************************************
+
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <sstream>
+
+namespace HM
+{
+
+// *****************************************************************************
+//
+// Class: AsyncLog
+//
+// the sink (a single one, see 'instance'), with the queue and the writer thread
+// Operations:
+//      push  : queue a message (any thread, never blocks)
+//      flush : wait until all the messages queued so far have been written
+//
+// *****************************************************************************
+
+class AsyncLog
+{
+   public:
+
+   static AsyncLog & instance();
+
+   void push( std::string && text );
+   void flush();
+
+   ~AsyncLog();
+
+   // --------------------------------------------------------------------------
+   private:
+
+   // node of the queue (intrusive singly linked list)
+   struct Node
+   {
+      std::atomic<Node *> next ;
+      std::string         text ;
+
+      Node() : next( nullptr ) {}
+   } ;
+
+   // queue (Vyukov MPSC): producers exchange 'head', the writer owns 'tail'
+   // ('tail' is always an already consumed node, initially a stub node)
+   alignas( 64 ) std::atomic<Node *> head ;
+   alignas( 64 ) Node *              tail ;
+
+   // number of messages pushed and written (for 'flush')
+   std::atomic<unsigned long> pushed, written ;
+
+   // the writer sleeps only when the queue is empty and 'sleeping' is set
+   std::atomic<bool>        sleeping ;
+   bool                     stop ;
+   std::mutex               mtx ;
+   std::condition_variable  wake_cv ;    // the writer waits here
+   std::condition_variable  flush_cv ;   // threads in 'flush' wait here
+
+   std::thread              writer ;
+
+   AsyncLog();
+
+   Node * pop();          // writer only: next message node (or nullptr)
+   void   write_loop();   // writer thread body
+} ;
+
+// *****************************************************************************
+//
+// Class: LogLine
+//
+// a line being formatted (with the usual stream operators), queued when the
+// object is destroyed (at the end of the full expression); an inactive line
+// (disabled, or moved from) formats and queues nothing
+//
+// *****************************************************************************
+
+class LogLine
+{
+   private:
+   std::ostringstream os ;
+   bool               active ;  // false once moved from
+
+   public:
+
+   explicit LogLine( bool p_active = true ) : active( p_active ) {}
+   LogLine( LogLine && other ) : os( std::move( other.os ) ), active( other.active )
+   {
+      other.active = false ;
+   }
+   ~LogLine() ;
+
+   template<class T> LogLine & operator << ( const T & value )
+   {
+      if ( active )
+         os << value ;
+      return *this ;
+   }
+
+   // manipulators (endl, setw, ...)
+   LogLine & operator << ( std::ostream & (*manip)( std::ostream & ) )
+   {
+      if ( active )
+         manip( os );
+      return *this ;
+   }
+} ;
+
+// start a line in the asynchronous sink (or a null line, if not 'enabled')
+inline LogLine async_log( bool enabled = true )
+{
+   return LogLine( enabled );
+}
+
+} // namespace HM end
+
+#endif // ifndef ASYNC_LOG_HPP
@@ -0,0 +1,446 @@
+// *****************************************************************************
+//
+// Hoare monitors for C++20 coroutines. Implementation.
+//
+// *****************************************************************************
+
+#include <cassert>
+#include <vector>
+#include "CoMonitor.hpp"
+
+namespace HM
+{
+
+// pool of the calling worker thread (nullptr outside the workers)
+static thread_local CoPool * current_pool = nullptr ;
+
+// *****************************************************************************
+//  CoQueue (FIFO of waiters)
+
+void CoQueue::push( CoWaiter * w )
+{
+  assert( w != nullptr );
+  w->next = nullptr ;
+  if ( tail == nullptr )
+    head = w ;
+  else
+    tail->next = w ;
+  tail = w ;
+  num_wt += 1 ;
+}
+// -----------------------------------------------------------------------------
+
+CoWaiter * CoQueue::pop()
+{
+  CoWaiter * w = head ;
+  if ( w == nullptr )
+    return nullptr ;
+
+  head = w->next ;
+  if ( head == nullptr )
+    tail = nullptr ;
+  w->next = nullptr ;
+  num_wt -= 1 ;
+  return w ;
+}
+// -----------------------------------------------------------------------------
+
+bool CoQueue::remove( CoWaiter * w )
+{
+  CoWaiter * prev = nullptr ;
+  for( CoWaiter * cur = head ; cur != nullptr ; prev = cur, cur = cur->next )
+  {
+    if ( cur != w )
+      continue ;
+
+    if ( prev == nullptr )
+      head = w->next ;
+    else
+      prev->next = w->next ;
+    if ( tail == w )
+      tail = prev ;
+    w->next = nullptr ;
+    num_wt -= 1 ;
+    return true ;
+  }
+  return false ;
+}
+
+// *****************************************************************************
+//  CoPool
+
+CoPool::CoPool( unsigned p_num_workers )
+:  num_workers( p_num_workers > 0 ? p_num_workers : 1 ),
+   live( 0 ),
+   idle( 0 )
+{
+}
+// -----------------------------------------------------------------------------
+
+CoPool & CoPool::current()
+{
+  assert( current_pool != nullptr );
+  return *current_pool ;
+}
+// -----------------------------------------------------------------------------
+
+CoPool::Detached CoPool::run_task( CoPool * pool, CoTask<> task )
+{
+  co_await task ;
+  pool->task_done();
+}
+// -----------------------------------------------------------------------------
+
+void CoPool::spawn( CoTask<> task )
+{
+  Detached d = run_task( this, std::move( task ) );
+
+  std::lock_guard<std::mutex> lock( mtx );
+  live++ ;
+  ready.push_back( d.handle );
+  if ( idle > 0 )
+    cv.notify_one();
+}
+// -----------------------------------------------------------------------------
+
+void CoPool::task_done()
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  if ( --live == 0 )
+    cv.notify_all();
+}
+// -----------------------------------------------------------------------------
+// the calling thread runs the workers until no spawned coroutine is left
+// (timers still pending then are dropped)
+
+void CoPool::run()
+{
+  std::vector<std::thread> workers ;
+  for( unsigned i = 0 ; i < num_workers ; i++ )
+    workers.push_back( std::thread( &CoPool::worker, this ) );
+  for( auto & w : workers )
+    w.join();
+}
+// -----------------------------------------------------------------------------
+
+void CoPool::worker()
+{
+  current_pool = this ;
+  std::unique_lock<std::mutex> lock( mtx );
+  unsigned long resumed = 0 ;
+
+  while ( live > 0 )
+  {
+    // due timers: when nothing is ready, and every few resumes otherwise (a
+    // busy ready queue must not hold them back for ever)
+    if ( ! timers.empty() && ( ready.empty() || resumed % timer_poll == 0 ) )
+    {
+      const auto first = timers.begin();
+      if ( first->first <= std::chrono::steady_clock::now() )
+      {
+        Timer t = std::move( first->second );
+        timers.erase( first );
+        lock.unlock();
+        if ( t.wait == nullptr )
+          t.handle.resume();
+        else if ( const std::coroutine_handle<> h = t.wait->monitor->expire( *t.wait ) )
+          h.resume();
+        lock.lock();
+        continue ;
+      }
+      if ( ready.empty() )
+      {
+        // sleep until the earliest timer expires (or something else happens)
+        idle++ ;
+        cv.wait_until( lock, first->first );
+        idle-- ;
+        continue ;
+      }
+    }
+
+    if ( ! ready.empty() )
+    {
+      const std::coroutine_handle<> h = ready.front();
+      ready.pop_front();
+      resumed++ ;
+      lock.unlock();
+      h.resume();
+      lock.lock();
+      continue ;
+    }
+
+    idle++ ;
+    cv.wait( lock );
+    idle-- ;
+  }
+  current_pool = nullptr ;
+}
+// -----------------------------------------------------------------------------
+
+void CoPool::schedule( std::coroutine_handle<> h )
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  ready.push_back( h );
+  if ( idle > 0 )
+    cv.notify_one();
+}
+// -----------------------------------------------------------------------------
+// (an idle worker may be sleeping until a later timer: it must recompute)
+
+void CoPool::add_timer( const std::chrono::steady_clock::time_point & time, std::coroutine_handle<> h )
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  timers.emplace( time, Timer{ h, nullptr } );
+  if ( idle > 0 )
+    cv.notify_one();
+}
+// -----------------------------------------------------------------------------
+
+void CoPool::add_timer( const std::chrono::steady_clock::time_point & time,
+                        const std::shared_ptr<CoTimedWaiter> & w )
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  timers.emplace( time, Timer{ nullptr, w } );
+  if ( idle > 0 )
+    cv.notify_one();
+}
+// -----------------------------------------------------------------------------
+// a signalled timed wait does not need its timer any more (and a busy monitor
+// would pile up lots of them); nothing if it has been taken by a worker
+
+void CoPool::cancel_timer( const CoTimedWaiter & w )
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  const auto range = timers.equal_range( w.deadline );
+  for( auto it = range.first ; it != range.second ; ++it )
+  {
+    if ( it->second.wait.get() == &w )
+    {
+      timers.erase( it );
+      return ;
+    }
+  }
+}
+// -----------------------------------------------------------------------------
+// a deadline not after the current time just puts the coroutine at the end of
+// the ready queue
+
+void CoPool::SleepAwaiter::await_suspend( std::coroutine_handle<> h )
+{
+  CoPool & pool = CoPool::current();
+  if ( time <= std::chrono::steady_clock::now() )
+    pool.schedule( h );
+  else
+    pool.add_timer( time, h );
+}
+
+// *****************************************************************************
+//  CoMonitor
+
+bool CoMonitor::EnterAwaiter::await_ready()
+{
+  std::lock_guard<std::mutex> lock( monitor.mtx );
+  if ( monitor.running )
+    return false ;
+  monitor.running = true ;
+  return true ;
+}
+// -----------------------------------------------------------------------------
+// the monitor may have been left since 'await_ready': enter without suspending
+// (returns false), otherwise queue up
+
+bool CoMonitor::EnterAwaiter::await_suspend( std::coroutine_handle<> h )
+{
+  std::lock_guard<std::mutex> lock( monitor.mtx );
+  if ( ! monitor.running )
+  {
+    monitor.running = true ;
+    return false ;
+  }
+  me.handle = h ;
+  monitor.monitor_queue.push( &me );
+  return true ;
+}
+// -----------------------------------------------------------------------------
+// the coroutine which gets the monitor when its owner releases it (urgent
+// queue first), or nullptr if none is waiting (then the monitor is free)
+
+std::coroutine_handle<> CoMonitor::next_owner()
+{
+  CoWaiter * w = urgent_queue.pop();
+  if ( w == nullptr )
+    w = monitor_queue.pop();
+  if ( w == nullptr )
+  {
+    running = false ;
+    return nullptr ;
+  }
+  handoffs++ ;
+  return w->handle ;
+}
+// -----------------------------------------------------------------------------
+
+void CoMonitor::leave()
+{
+  std::coroutine_handle<> next ;
+  {
+    std::lock_guard<std::mutex> lock( mtx );
+    assert( running );
+    next = next_owner();
+  }
+  if ( next )
+    CoPool::current().schedule( next );
+}
+// -----------------------------------------------------------------------------
+// first waiter of a condition queue, about to be signalled
+
+CoWaiter * CoMonitor::pop_signalled( CoQueue & q )
+{
+  CoWaiter * w = q.pop();
+  if ( w != nullptr && w->timed )
+  {
+    CoTimedWaiter * tw = static_cast<CoTimedWaiter *>( w );
+    tw->done = true ;                                  // its timer does nothing
+    CoPool::current().cancel_timer( *tw );
+  }
+  return w ;
+}
+// -----------------------------------------------------------------------------
+// a timed wait has expired: leave the condition queue and re-enter the
+// monitor, returns the coroutine to resume if it is free (otherwise it waits
+// in the monitor queue)
+
+std::coroutine_handle<> CoMonitor::expire( CoTimedWaiter & w )
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  if ( w.done )
+    return nullptr ;
+
+  w.done      = true ;
+  w.timed_out = true ;
+  w.queue->remove( &w );
+  if ( running )
+  {
+    monitor_queue.push( &w );
+    return nullptr ;
+  }
+  running = true ;
+  return w.handle ;
+}
+// -----------------------------------------------------------------------------
+
+CoCondVar CoMonitor::newCondVar()
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  cond_queues.emplace_back();
+  return CoCondVar( this, &cond_queues.back() );
+}
+// -----------------------------------------------------------------------------
+
+unsigned long CoMonitor::get_handoffs()
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  return handoffs ;
+}
+
+// *****************************************************************************
+//  CoCondVar
+
+// wait: enter the condition queue and hand the monitor over to the next
+// coroutine, which runs at once in this worker thread
+
+std::coroutine_handle<> CoCondVar::WaitAwaiter::await_suspend( std::coroutine_handle<> h )
+{
+  std::coroutine_handle<> next ;
+  {
+    std::lock_guard<std::mutex> lock( monitor.mtx );
+    me.handle = h ;
+    queue.push( &me );
+    next = monitor.next_owner();
+  }
+  return next ? next : std::noop_coroutine() ;
+}
+// -----------------------------------------------------------------------------
+
+CoCondVar::TimedWaitAwaiter CoCondVar::wait_until( const std::chrono::steady_clock::time_point & deadline )
+{
+  std::shared_ptr<CoTimedWaiter> w = std::make_shared<CoTimedWaiter>();
+  w->timed    = true ;
+  w->monitor  = monitor ;
+  w->queue    = queue ;
+  w->deadline = deadline ;
+  return TimedWaitAwaiter{ deadline, w } ;
+}
+// -----------------------------------------------------------------------------
+
+std::coroutine_handle<> CoCondVar::TimedWaitAwaiter::await_suspend( std::coroutine_handle<> h )
+{
+  CoMonitor & m = *me->monitor ;
+  std::coroutine_handle<> next ;
+  {
+    std::lock_guard<std::mutex> lock( m.mtx );
+    me->handle = h ;
+    me->queue->push( me.get() );
+    CoPool::current().add_timer( deadline, me );
+    next = m.next_owner();
+  }
+  return next ? next : std::noop_coroutine() ;
+}
+// -----------------------------------------------------------------------------
+// signal: hand the monitor over to the first waiter, which runs at once in
+// this worker thread, and wait in the urgent queue (nothing if no waiter)
+
+std::coroutine_handle<> CoCondVar::SignalAwaiter::await_suspend( std::coroutine_handle<> h )
+{
+  std::lock_guard<std::mutex> lock( monitor.mtx );
+  CoWaiter * w = monitor.pop_signalled( queue );
+  if ( w == nullptr )
+    return h ;
+
+  me.handle = h ;
+  monitor.urgent_queue.push( &me );
+  monitor.handoffs++ ;
+  return w->handle ;
+}
+// -----------------------------------------------------------------------------
+// each waiter runs in turn, and the signaller waits in the urgent queue
+// after each one, as in the threads version: only those waiting now are
+// signalled (one which waits again on this condition is not signalled twice)
+
+CoTask<> CoCondVar::signal_all()
+{
+  for ( unsigned n = get_nwt() ; n > 0 ; n-- )
+    co_await signal();
+}
+// -----------------------------------------------------------------------------
+// the signalled coroutine (or the next one waiting to enter) gets the monitor,
+// and the scope of the signaller no longer owns it
+
+void CoCondVar::signal_and_leave( CoMonitor::Scope & scope )
+{
+  assert( scope.monitor == monitor );
+  std::coroutine_handle<> next ;
+  {
+    std::lock_guard<std::mutex> lock( monitor->mtx );
+    CoWaiter * w = monitor->pop_signalled( *queue );
+    if ( w != nullptr )
+    {
+      monitor->handoffs++ ;
+      next = w->handle ;
+    }
+    else
+      next = monitor->next_owner();
+  }
+  scope.monitor = nullptr ;
+  if ( next )
+    CoPool::current().schedule( next );
+}
+// -----------------------------------------------------------------------------
+
+unsigned CoCondVar::get_nwt()
+{
+  std::lock_guard<std::mutex> lock( monitor->mtx );
+  return queue->get_nwt();
+}
+
+} // namespace HM end
@@ -0,0 +1,433 @@
+// *****************************************************************************
+//
+// Hoare monitors for C++20 coroutines. Declarations.
+//
+// The monitors of HoareMonitor.hpp (Hoare semantics: "signal and urgent
+// wait"), for coroutines instead of threads: entering a monitor, waiting on a
+// condition and signalling suspend the calling coroutine, never the worker
+// thread running it, so a small fixed pool of threads (CoPool) runs any
+// number of coroutines (millions, each one needs just a few hundred bytes).
+//
+// Monitor procedures are coroutines returning CoTask, and they enter the
+// monitor explicitly; the returned scope leaves it when destroyed:
+//
+//    CoTask<bool> Barberia::cortarPelo( int i )
+//    {
+//       auto dentro = co_await enter();
+//       while ( barberos_libres.empty() )
+//          co_await c_clientes.wait();
+//       ....
+//       co_await c_barbero[b].signal();
+//       ....
+//       co_return true ;      // leaves the monitor
+//    }
+//
+//    called as:  co_await barberia.cortarPelo( i );
+//
+// Note: g++ 12 miscompiles a 'co_await' inside the condition of an 'if' or a
+// loop, so keep the awaited value in a variable first:
+//
+//    const bool seguir = co_await barberia.cortarPelo( i );
+//    if ( ! seguir ) ....
+//
+// The monitor is handed over directly (baton passing) to the next coroutine.
+// On wait and signal the next coroutine is resumed at once by the same worker
+// thread (symmetric transfer), without going through the pool queue.
+//
+// (requires C++20: compile with -std=c++20)
+//
+// *****************************************************************************
+
+#ifndef CO_MONITOR_HPP
+#define CO_MONITOR_HPP
+
+#include <coroutine>
+#include <exception>  // terminate
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>     // shared_ptr
+#include <string>
+#include <utility>    // move, exchange
+
+namespace HM
+{
+
+class CoMonitor ;
+class CoPool ;
+
+// *****************************************************************************
+//
+// Class: CoTask
+//
+// A coroutine returning a value of type T (or nothing). It starts when awaited,
+// and when it ends the awaiting coroutine is resumed at once (symmetric
+// transfer). The task object owns the coroutine frame.
+//
+// *****************************************************************************
+
+template<class T> struct CoTaskResult
+{
+   T value {} ;
+   void return_value( T v ) { value = std::move( v ); }
+   T    take()              { return std::move( value ); }
+} ;
+
+template<> struct CoTaskResult<void>
+{
+   void return_void() {}
+   void take()        {}
+} ;
+
+template<class T = void> class CoTask
+{
+   public:
+
+   struct promise_type : CoTaskResult<T>
+   {
+      std::coroutine_handle<> continuation ;  // the awaiting coroutine
+
+      CoTask get_return_object()
+      {
+         return CoTask( std::coroutine_handle<promise_type>::from_promise( *this ) );
+      }
+      std::suspend_always initial_suspend() noexcept { return {} ; }
+
+      struct FinalAwaiter
+      {
+         bool await_ready() noexcept { return false ; }
+         std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> h ) noexcept
+         {
+            const std::coroutine_handle<> c = h.promise().continuation ;
+            return c ? c : std::noop_coroutine() ;
+         }
+         void await_resume() noexcept {}
+      } ;
+      FinalAwaiter final_suspend() noexcept { return {} ; }
+
+      // exceptions are not supported (as in monitor procedures run by threads)
+      void unhandled_exception() { std::terminate(); }
+   } ;
+
+   CoTask( CoTask && other ) : handle( std::exchange( other.handle, nullptr ) ) {}
+   CoTask( const CoTask & ) = delete ;
+   ~CoTask() { if ( handle ) handle.destroy(); }
+
+   // awaiting the task runs it
+   bool await_ready() { return false ; }
+   std::coroutine_handle<> await_suspend( std::coroutine_handle<> caller )
+   {
+      handle.promise().continuation = caller ;
+      return handle ;
+   }
+   T await_resume() { return handle.promise().take(); }
+
+   // --------------------------------------------------------------------------
+   private:
+
+   std::coroutine_handle<promise_type> handle ;
+
+   explicit CoTask( std::coroutine_handle<promise_type> h ) : handle( h ) {}
+} ;
+
+// *****************************************************************************
+//
+// Class CoQueue
+//
+// A FIFO queue of suspended coroutines (waiters), as an intrusive singly
+// linked list, like ThreadsQueue: waiters live in the awaiter objects (inside
+// the coroutine frames), so no memory is allocated for waiting.
+// All operations must be done while holding the monitor 'mtx'.
+//
+// *****************************************************************************
+
+struct CoWaiter
+{
+   std::coroutine_handle<> handle ;
+   CoWaiter *              next  = nullptr ;
+   bool                    timed = false ;   // it is a CoTimedWaiter
+} ;
+
+class CoQueue
+{
+   private:
+
+   CoWaiter * head   = nullptr ;
+   CoWaiter * tail   = nullptr ;
+   unsigned   num_wt = 0 ;
+
+   public:
+
+   void       push( CoWaiter * w );
+   CoWaiter * pop();
+   bool       remove( CoWaiter * w );
+   unsigned   get_nwt() const { return num_wt ; }
+} ;
+
+// a timed wait on a condition: shared by the waiting coroutine and the pool
+// timer. Signalling cancels the timer, but it may have expired already (then
+// 'done' is already set, and the timer does nothing)
+
+struct CoTimedWaiter : public CoWaiter
+{
+   CoMonitor *                           monitor   = nullptr ;
+   CoQueue *                             queue     = nullptr ;
+   std::chrono::steady_clock::time_point deadline ;
+   bool                                  done      = false ;   // signalled or expired (protected by the monitor 'mtx')
+   bool                                  timed_out = false ;
+} ;
+
+// *****************************************************************************
+//
+// Class CoPool
+//
+// A fixed pool of worker threads running coroutines, with a FIFO queue of
+// coroutines ready to run and the timers for sleeps and timed waits.
+// Operations:
+//      spawn        : start a coroutine (it runs when 'run' is called)
+//      run          : run the workers until all spawned coroutines have ended
+//      current      : the pool of the calling worker thread
+//      sleep_for, sleep_until : suspend the calling coroutine for a while
+//                     (a zero duration just lets other coroutines run)
+//
+// *****************************************************************************
+
+class CoPool
+{
+   public:
+
+   explicit CoPool( unsigned p_num_workers );
+
+   void spawn( CoTask<> task );
+   void run();
+
+   static CoPool & current();
+
+   struct SleepAwaiter
+   {
+      std::chrono::steady_clock::time_point time ;
+
+      bool await_ready() { return false ; }
+      void await_suspend( std::coroutine_handle<> h );
+      void await_resume() {}
+   } ;
+
+   static SleepAwaiter sleep_until( const std::chrono::steady_clock::time_point & time )
+   {
+      return SleepAwaiter{ time } ;
+   }
+   template<class Rep, class Period>
+   static SleepAwaiter sleep_for( const std::chrono::duration<Rep,Period> & duration )
+   {
+      return SleepAwaiter{ std::chrono::steady_clock::now()
+                 + std::chrono::duration_cast<std::chrono::steady_clock::duration>( duration ) } ;
+   }
+
+   // (used by the monitors and the awaiters)
+   void schedule( std::coroutine_handle<> h );
+   void add_timer( const std::chrono::steady_clock::time_point & time, std::coroutine_handle<> h );
+   void add_timer( const std::chrono::steady_clock::time_point & time,
+                   const std::shared_ptr<CoTimedWaiter> & w );
+   void cancel_timer( const CoTimedWaiter & w );
+
+   // --------------------------------------------------------------------------
+   private:
+
+   // a pending timer: resume a sleeping coroutine, or expire a timed wait
+   struct Timer
+   {
+      std::coroutine_handle<>         handle ;
+      std::shared_ptr<CoTimedWaiter>  wait ;
+   } ;
+
+   // coroutine started by 'spawn': runs the task, then counts it as finished
+   struct Detached
+   {
+      struct promise_type
+      {
+         Detached get_return_object()
+         {
+            return Detached{ std::coroutine_handle<promise_type>::from_promise( *this ) } ;
+         }
+         std::suspend_always initial_suspend() noexcept { return {} ; }
+         std::suspend_never  final_suspend() noexcept   { return {} ; }
+         void return_void() {}
+         void unhandled_exception() { std::terminate(); }
+      } ;
+      std::coroutine_handle<promise_type> handle ;
+   } ;
+
+   static constexpr unsigned long timer_poll = 64 ;   // resumes between timer checks
+
+   const unsigned                                              num_workers ;
+   std::mutex                                                  mtx ;
+   std::condition_variable                                     cv ;      // idle workers wait here
+   std::deque<std::coroutine_handle<>>                         ready ;
+   std::multimap<std::chrono::steady_clock::time_point,Timer>  timers ;
+   unsigned long                                               live ;    // spawned and not finished
+   unsigned                                                    idle ;    // workers waiting in 'cv'
+
+   static Detached run_task( CoPool * pool, CoTask<> task );
+   void task_done();
+   void worker();
+} ;
+
+// *****************************************************************************
+//
+// Class: CoMonitor
+//
+// Base class for monitors used from coroutines (Hoare semantics).
+// Concrete monitors derive from this class, and create their condition
+// variables with 'newCondVar'. Each procedure starts with
+// 'auto scope = co_await enter();'
+//
+// *****************************************************************************
+
+class CoCondVar ;
+
+class CoMonitor
+{
+   public:
+
+   // ownership of the monitor, in a procedure: leaves the monitor when
+   // destroyed (unless the monitor was left with 'signal_and_leave')
+   class [[nodiscard]] Scope
+   {
+      public:
+      Scope( Scope && other ) : monitor( std::exchange( other.monitor, nullptr ) ) {}
+      ~Scope() { if ( monitor != nullptr ) monitor->leave(); }
+
+      private:
+      friend class CoMonitor ;
+      friend class CoCondVar ;
+      CoMonitor * monitor ;
+      explicit Scope( CoMonitor * m ) : monitor( m ) {}
+   } ;
+
+   struct EnterAwaiter
+   {
+      CoMonitor & monitor ;
+      CoWaiter    me ;
+
+      bool  await_ready();
+      bool  await_suspend( std::coroutine_handle<> h );
+      Scope await_resume() { return Scope( &monitor ); }
+   } ;
+
+   const std::string & get_name() const { return name ; }
+
+   // number of times the monitor has been handed over to a waiting coroutine
+   unsigned long get_handoffs() ;
+
+   // --------------------------------------------------------------------------
+   protected:
+
+   CoMonitor( const std::string & p_name = "(unnamed)" ) : name( p_name ) {}
+   ~CoMonitor() {}
+
+   EnterAwaiter enter() { return EnterAwaiter{ *this, CoWaiter() } ; }
+   CoCondVar    newCondVar() ;
+
+   // --------------------------------------------------------------------------
+   private:
+
+   friend class CoCondVar ;
+   friend class CoPool ;
+
+   const std::string    name ;
+   std::mutex           mtx ;             // protects all the fields below
+   bool                 running = false ; // a coroutine owns the monitor
+   CoQueue              monitor_queue ;   // coroutines waiting to enter
+   CoQueue              urgent_queue ;    // signallers waiting to re-enter
+   std::deque<CoQueue>  cond_queues ;     // one per condition variable
+   unsigned long        handoffs = 0 ;
+
+   void                    leave();
+   std::coroutine_handle<> next_owner();                 // (mtx held)
+   CoWaiter *              pop_signalled( CoQueue & q ); // (mtx held)
+   std::coroutine_handle<> expire( CoTimedWaiter & w );
+} ;
+
+// *****************************************************************************
+//
+// Class: CoCondVar
+//
+// Condition variables of a CoMonitor (Hoare semantics): the signalled
+// coroutine runs at once, and the signaller waits in the urgent queue.
+// Waiting and signalling are awaited:
+//      co_await c.wait();           bool ok = co_await c.wait_for( 10ms );
+//      co_await c.signal();         co_await c.signal_all();
+//      c.signal_and_leave( scope ); // last operation, the scope is released
+//
+// *****************************************************************************
+
+class CoCondVar
+{
+   public:
+
+   CoCondVar() : monitor( nullptr ), queue( nullptr ) {}
+
+   struct WaitAwaiter
+   {
+      CoMonitor & monitor ;
+      CoQueue &   queue ;
+      CoWaiter    me ;
+
+      bool await_ready() { return false ; }
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<> h );
+      void await_resume() {}
+   } ;
+
+   struct TimedWaitAwaiter
+   {
+      std::chrono::steady_clock::time_point  deadline ;
+      std::shared_ptr<CoTimedWaiter>         me ;
+
+      bool await_ready() { return false ; }
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<> h );
+      bool await_resume() { return ! me->timed_out ; }  // true if signalled
+   } ;
+
+   struct SignalAwaiter
+   {
+      CoMonitor & monitor ;
+      CoQueue &   queue ;
+      CoWaiter    me ;
+
+      bool await_ready() { return false ; }
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<> h );
+      void await_resume() {}
+   } ;
+
+   WaitAwaiter      wait()   { return WaitAwaiter{ *monitor, *queue, CoWaiter() } ; }
+   TimedWaitAwaiter wait_until( const std::chrono::steady_clock::time_point & deadline );
+   template<class Rep, class Period>
+   TimedWaitAwaiter wait_for( const std::chrono::duration<Rep,Period> & timeout )
+   {
+      return wait_until( std::chrono::steady_clock::now()
+               + std::chrono::duration_cast<std::chrono::steady_clock::duration>( timeout ) );
+   }
+   SignalAwaiter    signal() { return SignalAwaiter{ *monitor, *queue, CoWaiter() } ; }
+   CoTask<>         signal_all();
+   void             signal_and_leave( CoMonitor::Scope & scope );
+
+   unsigned get_nwt() ;
+   bool     empty() { return get_nwt() == 0 ; }
+
+   // --------------------------------------------------------------------------
+   private:
+
+   friend class CoMonitor ;
+
+   CoMonitor * monitor ;
+   CoQueue *   queue ;
+
+   CoCondVar( CoMonitor * p_monitor, CoQueue * p_queue ) : monitor( p_monitor ), queue( p_queue ) {}
+} ;
+
+} // namespace HM end
+
+#endif // ifndef CO_MONITOR_HPP
@@ -12,6 +12,29 @@
 #include <cassert>
 #include <thread>  // incluye std::this_thread::get_id()
 #include <system_error>
+#include <algorithm> // min
+#include <chrono>
+#include <ctime>     // timespec
+#include <atomic>
+#include <deque>
+#include <map>
+#include <iomanip>   // setw
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>     // __rdtsc
+#endif
+#ifdef TRAZA_M
+#include <csignal>         // signal, raise
+#include <cstdio>          // snprintf
+#include <cstdlib>         // getenv, atexit
+#include <cstring>         // memcpy, strncpy
+#include <fcntl.h>         // open
+#include <unistd.h>        // write, close
+#endif
+#ifdef __linux__
+#include <unistd.h>        // syscall
+#include <sys/syscall.h>   // SYS_futex
+#include <linux/futex.h>   // FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+#endif
 #include "HoareMonitor.hpp"
 
 namespace HM
@@ -22,381 +45,2396 @@ using namespace std ;
 
 // *****************************************************************************
 //
-// Class ThreadsQueue
+// Virtual time scheduler (declarations, implementation below ParkSlot)
 //
+// A single thread of the simulation (the 'current' one) runs at any time. The
+// others are ready (in the FIFO 'ready'), parked in a monitor queue (waiting
+// for 'unpark', maybe with a deadline) or sleeping until a deadline. The
+// deadlines are kept in 'timers', ordered by time and then by registration
+// order, so the same program always runs the same way.
+// All this state is protected by 'mtx'.
+
+// deadline of a timer: nanoseconds since VirtualTime::origin, and registration number
+typedef std::pair<long long,uint64_t> VirtualTimerKey ;
+
+struct VirtualActor
+{
+   std::condition_variable  cv ;        // the thread waits here for its turn
+   bool                     turn ;      // the thread must run now
+   bool                     granted ;   // unparked, not consumed by 'park' yet
+   bool                     parked ;    // waiting in 'park' for 'unpark'
+   bool                     has_timer ; // a deadline is registered in 'timers'
+   VirtualTimerKey          timer ;     // (its key)
+
+   VirtualActor() : turn( false ), granted( false ), parked( false ), has_timer( false ) {}
+} ;
+
+struct VirtualScheduler
+{
+   static std::mutex                                 mtx ;
+   static VirtualActor *                             current ;    // nullptr if none is running
+   static std::deque<VirtualActor *>                 ready ;
+   static std::map<VirtualTimerKey,VirtualActor *>   timers ;
+   static uint64_t                                   num_timers ; // timers registered so far
+
+   static bool park( VirtualActor & a, const std::chrono::steady_clock::time_point * deadline );
+   static void unpark( VirtualActor & a );
+   static void sleep_until( VirtualActor & a, const std::chrono::steady_clock::time_point & time );
+
+   static void attach( VirtualActor * a );
+   static void detach();
+   static void run( VirtualActor * a, std::function<void()> body );
+
+   private:
+   static void      dispatch();
+   static void      wait_turn( VirtualActor & a, std::unique_lock<std::mutex> & lock );
+   static void      add_timer( VirtualActor & a, long long time );
+   static long long to_elapsed( const std::chrono::steady_clock::time_point & time );
+} ;
+
+// *****************************************************************************
+//
+// Class ParkSlot
 //
-// A thread queue with two states: close or open
-// Equivalent to a binary semaphore, with values 0 (closed) or 1 (open)
+// Per-thread blocking slot: every thread owns exactly one (thread local), which
+// is used whenever the thread blocks in any monitor queue (a thread cannot be
+// in two queues at once). On Linux the slot is a futex word, elsewhere it
+// falls back to a mutex and a condition variable.
 // Operations:
-//      wait   : if closed then do blocked wait, if open do not wait and close
-//      signal : if any thread is waiting then signal one, if none is waiting then just open
+//      park       : block the owner thread until the slot is unparked
+//      park_until : the same, giving up at a deadline (returns false then)
+//      unpark     : wake up the owner thread (called from any other thread)
+//
+// The slot word is 'empty' (0), 'granted' (1) or 'sleeping' (2). The owner
+// spins a few iterations before sleeping, and 'unpark' only does a system
+// call when the owner is really sleeping in the kernel.
+// Threads taking part in a simulation (see VirtualTime) park through the
+// virtual time scheduler instead.
 
-class ThreadsQueue
+class ParkSlot
 {
    private:
 
-   bool                      open ;   // current state
-   std::condition_variable   queue ;  // queue with waiting threads
-   unsigned                  num_wt ; // current number of waiting threads
+   std::atomic<int>  state ;   // empty, granted or sleeping
+
+   public:
+   VirtualActor *    actor ;   // simulated thread owning the slot (nullptr if none)
+
+   private:
+
+#ifndef __linux__
+   std::mutex               mtx ;  // protects sleeping and waking up
+   std::condition_variable  cv ;   // the owner thread sleeps here
+#endif
+
+   static const int empty    = 0 ,
+                    granted  = 1 ,
+                    sleeping = 2 ;
+
+   // block in the kernel while state == sleeping, or until the deadline
+   // (if not null) has passed
+   void sleep( const std::chrono::steady_clock::time_point * deadline );
+   void wake();   // wake up the sleeping owner
+
+   // spin for a while, waiting to be granted (returns true if granted)
+   bool spin();
 
    public:
 
-   ThreadsQueue( bool p_open ) ;
+   ParkSlot() ;
 
-   void     wait( std::unique_lock<std::mutex> & lock );
-   bool     signal();
-   unsigned get_nwt() const;
+   void park();
+   bool park_until( const std::chrono::steady_clock::time_point & deadline );
+   void unpark();
 
+   // slot owned by the calling thread
+   static ParkSlot & current();
 } ;
 
 // *****************************************************************************
-//  ThreadQueue (binary semaphore)
+//  ParkSlot
+
+// number of iterations to spin in 'park' before sleeping
+// (no spinning at all on a single processor, it could only delay the waker)
+static const unsigned park_spins = std::thread::hardware_concurrency() > 1 ? 100 : 0 ;
 
-ThreadsQueue::ThreadsQueue( bool p_open )
+static inline void cpu_relax()
 {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+// -----------------------------------------------------------------------------
 
-  open = p_open ;
-  num_wt = 0 ;
+ParkSlot::ParkSlot()
+:  state( empty ),
+   actor( nullptr )
+{
 }
 // -----------------------------------------------------------------------------
 
-unsigned ThreadsQueue::get_nwt(  ) const
+ParkSlot & ParkSlot::current()
 {
-  return num_wt ;
+  static thread_local ParkSlot slot ;
+  return slot ;
 }
 // -----------------------------------------------------------------------------
-// wait operation: the caller thread must own the lock
-// if the queue is "closed" (open==false),
-//        the caller releases the lock and blocks
-//        when it is waked up, it waits to reacquire the lock
-//        the queue reamins closed, the caller ends this call
-// if the queue is "opened" (open==true)
-//        the caller does not block, ends this call
-//        the queue is closed (open=false)
-//
-// (the caller thread must own the mutex in the parameter, later this mutex
-// must be owned by the thread signalling this queue)
+// spin, waiting for a handoff which may be only nanoseconds away
+// (if granted, the slot is left empty, ready for the next park)
 
-void ThreadsQueue::wait( std::unique_lock<std::mutex> & lock )
+bool ParkSlot::spin()
 {
-  // wait while value is false (must be 'while' because of possible spurious wakeups )
-  num_wt += 1 ;       // one more waiting thread
-  while ( not open )  // use of while (instead of 'if') avoids errors due to spurious wake-ups
-    queue.wait( lock );
-  num_wt -= 1 ;       // one less waiting thread
+  for( unsigned i = 0 ; i < park_spins ; i++ )
+  {
+    if ( state.load( std::memory_order_acquire ) == granted )
+    {
+      state.store( empty, std::memory_order_relaxed );
+      return true ;
+    }
+    cpu_relax();
+  }
+  return false ;
+}
+// -----------------------------------------------------------------------------
+// block the calling thread (the owner of the slot) until it is unparked
+// (must be called without holding 'queues_mtx')
+
+void ParkSlot::park()
+{
+  if ( actor != nullptr )
+  {
+    VirtualScheduler::park( *actor, nullptr );
+    return ;
+  }
+  if ( spin() )
+    return ;
 
-  // close the queue
-  assert( open );
-  open = false ;
+  // announce the owner is going to sleep, unless it has just been granted
+  int expected = empty ;
+  if ( state.compare_exchange_strong( expected, sleeping, std::memory_order_acquire ) )
+    sleep( nullptr );   // returns once state != sleeping
+
+  assert( state.load( std::memory_order_relaxed ) == granted );
+  state.store( empty, std::memory_order_relaxed );  // ready for the next park
 }
 // -----------------------------------------------------------------------------
-// signal operation
-//    opens the queue (set value="true"), then:
-//    if there was any waiting thread
-//       caller thread ends the call, returns true
-//       a thread is waked-up, this thread closes the queue and continues
-//    if there was no waiting thread
-//       returns false
-//
+// block the calling thread until it is unparked or the deadline has passed,
+// returns true if unparked, false on timeout (then a later 'unpark' is still
+// possible, and it must be consumed with 'park' before parking again)
 
-bool ThreadsQueue::signal( )
+bool ParkSlot::park_until( const std::chrono::steady_clock::time_point & deadline )
 {
-  // open the queue
-  open = true ;
+  if ( actor != nullptr )
+    return VirtualScheduler::park( *actor, &deadline );
+  if ( spin() )
+    return true ;
 
-  // signal one waiting thread, if any
-  if ( 0 < num_wt )
+  int expected = empty ;
+  if ( state.compare_exchange_strong( expected, sleeping, std::memory_order_acquire ) )
   {
-    queue.notify_one() ;  // wake up one waiting thread
-    return true ;         // free mutex, end, after return queue will be closed by waked up thread
+    sleep( &deadline );   // returns once state != sleeping, or on timeout
+
+    // timeout: go back to empty, unless granted in the meanwhile
+    expected = sleeping ;
+    if ( state.compare_exchange_strong( expected, empty, std::memory_order_acquire ) )
+      return false ;
   }
-  else
-    return false ;          // free mutex, end, queue remains open
+
+  assert( state.load( std::memory_order_relaxed ) == granted );
+  state.store( empty, std::memory_order_relaxed );  // ready for the next park
+  return true ;
+}
+// -----------------------------------------------------------------------------
+// wake up the owner thread of the slot (possibly before it calls 'park')
+
+void ParkSlot::unpark()
+{
+  if ( actor != nullptr )
+  {
+    VirtualScheduler::unpark( *actor );
+    return ;
+  }
+  if ( state.exchange( granted, std::memory_order_release ) == sleeping )
+    wake();
+}
+// -----------------------------------------------------------------------------
+
+#ifdef __linux__
+
+void ParkSlot::sleep( const std::chrono::steady_clock::time_point * deadline )
+{
+  // use of while (instead of 'if') avoids errors due to spurious wake-ups
+  while ( state.load( std::memory_order_acquire ) == sleeping )
+  {
+    if ( deadline == nullptr )
+    {
+      syscall( SYS_futex, reinterpret_cast<int *>( &state ), FUTEX_WAIT_PRIVATE,
+               sleeping, nullptr, nullptr, 0 );
+      continue ;
+    }
+
+    // FUTEX_WAIT takes a relative timeout
+    const auto now = std::chrono::steady_clock::now();
+    if ( *deadline <= now )
+      return ;
+    const long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>( *deadline - now ).count();
+    struct timespec ts ;
+    ts.tv_sec  = time_t( ns / 1000000000LL );
+    ts.tv_nsec = long( ns % 1000000000LL );
+    syscall( SYS_futex, reinterpret_cast<int *>( &state ), FUTEX_WAIT_PRIVATE,
+             sleeping, &ts, nullptr, 0 );
+  }
+}
+// -----------------------------------------------------------------------------
+
+void ParkSlot::wake()
+{
+  syscall( SYS_futex, reinterpret_cast<int *>( &state ), FUTEX_WAKE_PRIVATE,
+           1, nullptr, nullptr, 0 );
+}
+
+#else
+
+void ParkSlot::sleep( const std::chrono::steady_clock::time_point * deadline )
+{
+  std::unique_lock<std::mutex> lock( mtx );
+  while ( state.load( std::memory_order_acquire ) == sleeping )
+  {
+    if ( deadline == nullptr )
+      cv.wait( lock );
+    else if ( cv.wait_until( lock, *deadline ) == std::cv_status::timeout )
+      return ;
+  }
+}
+// -----------------------------------------------------------------------------
+
+void ParkSlot::wake()
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  cv.notify_one();
 }
 
+#endif
+
 // *****************************************************************************
 //
-// Class: CondVar
+// Virtual time
 //
 // *****************************************************************************
 
-// create an unusable, not initialized condition variable
+std::atomic<bool>                      VirtualTime::started( false ) ;
+std::chrono::steady_clock::time_point  VirtualTime::origin ;
+std::atomic<long long>                 VirtualTime::elapsed( 0 ) ;
+
+std::mutex                                VirtualScheduler::mtx ;
+VirtualActor *                            VirtualScheduler::current = nullptr ;
+std::deque<VirtualActor *>                VirtualScheduler::ready ;
+std::map<VirtualTimerKey,VirtualActor *>  VirtualScheduler::timers ;
+uint64_t                                  VirtualScheduler::num_timers = 0 ;
 
-CondVar::CondVar()
-{
-   monitor = nullptr ;
-}
 // -----------------------------------------------------------------------------
-//  create an usable condition variable
+// the calling thread becomes the first (and running) thread of the simulation
 
-CondVar::CondVar( HoareMonitor * p_monitor, unsigned p_index )
+void VirtualTime::start()
 {
-   assert( p_monitor != nullptr );
-   assert( p_index == (p_monitor->queues).size()-1 );
+  assert( ! active() );
+  origin = std::chrono::steady_clock::now();
+  elapsed.store( 0, std::memory_order_relaxed );
 
-   monitor = p_monitor ;
-   index   = p_index ;
+  VirtualActor * a = new VirtualActor ;
+  {
+    std::lock_guard<std::mutex> lock( VirtualScheduler::mtx );
+    VirtualScheduler::current = a ;
+  }
+  VirtualScheduler::attach( a );
+  started.store( true, std::memory_order_release );
 }
 // -----------------------------------------------------------------------------
-// unconditionally wait on the underlying thread queue
 
-void CondVar::wait()
+void VirtualTime::leave()
 {
-   assert( monitor != nullptr );
-   monitor->wait( index ) ;
+  VirtualScheduler::detach();
 }
 // -----------------------------------------------------------------------------
-// signal operation, with "urgent wait" semantics
 
-void CondVar::signal()
+void VirtualTime::sleep_until( const std::chrono::steady_clock::time_point & time )
 {
-   assert( monitor != nullptr );
-   monitor->signal( index );
+  VirtualActor * a = ParkSlot::current().actor ;
+  if ( ! active() )
+    std::this_thread::sleep_until( time );
+  else if ( a == nullptr )
+    std::this_thread::sleep_for( time - now() );   // not in the simulation: real time
+  else
+    VirtualScheduler::sleep_until( *a, time );
 }
 // -----------------------------------------------------------------------------
-// returns number of threads waiting in the cond.var.
+// the new thread is ready at once, it will run when its turn comes
 
-unsigned CondVar::get_nwt()
+std::thread VirtualTime::spawn_body( std::function<void()> && body )
 {
-   assert( monitor != nullptr );
-   return monitor->get_nwt( index );
+  if ( ! active() )
+    return std::thread( std::move( body ) );
+
+  VirtualActor * a = new VirtualActor ;
+  {
+    std::lock_guard<std::mutex> lock( VirtualScheduler::mtx );
+    VirtualScheduler::ready.push_back( a );
+  }
+  return std::thread( VirtualScheduler::run, a, std::move( body ) );
 }
 
 // *****************************************************************************
-//
-// Class: HoareMonitor
-//
-// *****************************************************************************
+//  VirtualScheduler
 
-void HoareMonitor::initialize()
+long long VirtualScheduler::to_elapsed( const std::chrono::steady_clock::time_point & time )
 {
-   running         = false ;
-   //reference_count = 0 ;
-   urgent_queue    = new ThreadsQueue( false );  // initially (and always) closed
-   monitor_queue   = new ThreadsQueue( true ); // initially open
+  return std::chrono::duration_cast<std::chrono::nanoseconds>( time - VirtualTime::origin ).count();
 }
 // -----------------------------------------------------------------------------
-HoareMonitor::HoareMonitor()
+// body of a thread created with VirtualTime::spawn
+
+void VirtualScheduler::run( VirtualActor * a, std::function<void()> body )
 {
-   name = "unknown" ;
-   initialize();
+  attach( a );
+  {
+    std::unique_lock<std::mutex> lock( mtx );
+    wait_turn( *a, lock );
+  }
+  body();
+  detach();
 }
 // -----------------------------------------------------------------------------
 
-HoareMonitor::HoareMonitor( const std::string & p_name )
+void VirtualScheduler::attach( VirtualActor * a )
 {
-   name = p_name ;
-   initialize();
+  ParkSlot::current().actor = a ;
 }
 // -----------------------------------------------------------------------------
-HoareMonitor::~HoareMonitor()
-{
-   //cout << "starts monitor destructor" << endl ;
+// the calling thread (the running one) leaves the simulation
 
-   assert( ! running );
+void VirtualScheduler::detach()
+{
+  ParkSlot &     slot = ParkSlot::current();
+  VirtualActor * a    = slot.actor ;
+  if ( a == nullptr )
+    return ;
+  slot.actor = nullptr ;
+
+  std::lock_guard<std::mutex> lock( mtx );
+  assert( current == a && ! a->has_timer );
+  delete a ;
+  dispatch();
+}
+// -----------------------------------------------------------------------------
+// give the turn to the next thread: the first ready one or, if none is ready,
+// the one with the earliest deadline (the clock jumps forward to it)
+// (the caller must hold 'mtx', and it stops running)
 
-   // destroy all threads queues
-   for( auto & tq_ptr : queues )
-   {
-      assert( tq_ptr != nullptr );
-      assert( tq_ptr->get_nwt() == 0 );
-      delete tq_ptr ;
-      tq_ptr = nullptr ;
-   }
+void VirtualScheduler::dispatch()
+{
+  VirtualActor * next = nullptr ;
 
-   assert( urgent_queue != nullptr );
-   assert( urgent_queue->get_nwt() == 0 );
-   delete urgent_queue ;
-   urgent_queue = nullptr ;
+  if ( ! ready.empty() )
+  {
+    next = ready.front();
+    ready.pop_front();
+  }
+  else if ( ! timers.empty() )
+  {
+    const auto first = timers.begin();
+    next = first->second ;
+    if ( VirtualTime::elapsed.load( std::memory_order_relaxed ) < first->first.first )
+      VirtualTime::elapsed.store( first->first.first, std::memory_order_relaxed );
+    timers.erase( first );
+    next->has_timer = false ;
+    next->parked    = false ;   // (a timed park expires)
+  }
 
-   assert( monitor_queue != nullptr );
-   assert( monitor_queue->get_nwt() == 0 );
-   delete monitor_queue ;
-   monitor_queue = nullptr ;
+  // (if no thread can run, the next 'unpark' from outside the simulation restarts it)
+  current = next ;
+  if ( next != nullptr )
+  {
+    next->turn = true ;
+    next->cv.notify_one();
+  }
+}
+// -----------------------------------------------------------------------------
 
+void VirtualScheduler::wait_turn( VirtualActor & a, std::unique_lock<std::mutex> & lock )
+{
+  while ( ! a.turn )
+    a.cv.wait( lock );
+  a.turn = false ;
+}
+// -----------------------------------------------------------------------------
 
-   //cout << "ends monitor destructor" << endl ;
+void VirtualScheduler::add_timer( VirtualActor & a, long long time )
+{
+  a.timer     = VirtualTimerKey( time, num_timers++ );
+  a.has_timer = true ;
+  timers[a.timer] = &a ;
 }
 // -----------------------------------------------------------------------------
+// ParkSlot::park and park_until for a thread in the simulation
 
-CondVar HoareMonitor::newCondVar()
+bool VirtualScheduler::park( VirtualActor & a, const std::chrono::steady_clock::time_point * deadline )
 {
-   queues.push_back( new ThreadsQueue( false ) ); // add threads queue to monitor
-   return CondVar( this, queues.size()-1 );       // built and return cond.var.
+  std::unique_lock<std::mutex> lock( mtx );
+  assert( current == &a );
+
+  if ( ! a.granted )
+  {
+    if ( deadline != nullptr )
+    {
+      const long long time = to_elapsed( *deadline );
+      if ( time <= VirtualTime::elapsed.load( std::memory_order_relaxed ) )
+        return false ;
+      add_timer( a, time );
+    }
+    a.parked = true ;
+    dispatch();
+    wait_turn( a, lock );
+
+    if ( ! a.granted )   // the deadline has passed
+      return false ;
+  }
+  a.granted = false ;
+  return true ;
 }
+// -----------------------------------------------------------------------------
 
+void VirtualScheduler::unpark( VirtualActor & a )
+{
+  std::lock_guard<std::mutex> lock( mtx );
+  a.granted = true ;
+  if ( ! a.parked )
+    return ;
+
+  a.parked = false ;
+  if ( a.has_timer )
+  {
+    timers.erase( a.timer );
+    a.has_timer = false ;
+  }
+  ready.push_back( &a );
+  if ( current == nullptr )
+    dispatch();
+}
 // -----------------------------------------------------------------------------
-// enter the monitor, waiting if neccesary
 
-void HoareMonitor::enter()
+void VirtualScheduler::sleep_until( VirtualActor & a, const std::chrono::steady_clock::time_point & time )
 {
-  // acquire queues access mutex
-  std::unique_lock<std::mutex> lock( queues_mtx );
+  std::unique_lock<std::mutex> lock( mtx );
+  assert( current == &a );
+
+  const long long t = to_elapsed( time );
+  if ( t <= VirtualTime::elapsed.load( std::memory_order_relaxed ) )
+    return ;
+  add_timer( a, t );
+  dispatch();
+  wait_turn( a, lock );
+}
 
-  // wait if the monitor queue is closed (other thread is running the monitor)
-  monitor_queue->wait( lock );
+// *****************************************************************************
+//
+// Class ThreadIdentity
+//
+// *****************************************************************************
 
-  assert( ! running );
-  // register this thread is running in the monitor
-  running = true ;
-  running_thread_id = std::this_thread::get_id();
+// next thread identifier to be assigned
+static std::atomic<unsigned> next_thread_ident( 0 ) ;
 
-  // release queues access mutex (destroy 'lock')
+ThreadIdentity * ThreadIdentity::create()
+{
+   return new ThreadIdentity( next_thread_ident.fetch_add( 1, std::memory_order_relaxed ) );
 }
 // -----------------------------------------------------------------------------
-// end running monitor code
+// the name is published once (registering the same name again is allowed),
+// and it also names the thread in the trace
+
+#ifdef TRAZA_M
+static void trace_set_thread_name( const std::string & name );
+#endif
 
-void HoareMonitor::leave()
+bool ThreadIdentity::set_name( const std::string & new_name )
 {
-  // check this is the thread running in the monitor
-  assert( running );
-  assert( std::this_thread::get_id() == running_thread_id );
+   const std::string * n        = new std::string( new_name ),
+                     * expected = nullptr ;
+   if ( name_ptr.compare_exchange_strong( expected, n, std::memory_order_acq_rel ) )
+   {
+#ifdef TRAZA_M
+      if ( this == &current() )
+         trace_set_thread_name( new_name );
+#endif
+      return true ;
+   }
 
-  // acquire queues access mutex
-  std::unique_lock<std::mutex> lock( queues_mtx );
+   delete n ;
+   return *expected == new_name ;
+}
+
+// *****************************************************************************
+//
+// Class Waiter
+//
+// A thread blocked in any monitor queue. Waiters live in the stack of the
+// blocked thread, linked in the intrusive list of the queue, and they are
+// granted the monitor ownership directly by the thread which releases it
+// (baton passing), so a waked up thread never has to compete again for
+// 'queues_mtx' before running in the monitor.
+// Operations:
+//      park   : block the calling thread until the waiter is granted
+//      unpark : grant the waiter and wake up its thread
+
+class Waiter
+{
+   public:
+
+   Waiter *                 next ;      // next waiter in the same queue
+   ParkSlot &               slot ;      // blocking slot of the waiting thread
+   const std::thread::id    thread_id ; // identifier of the blocked thread
+
+   Waiter() ;
+
+   void park()   { slot.park(); }
+   void unpark() { slot.unpark(); }
+
+   bool park_until( const std::chrono::steady_clock::time_point & deadline )
+   {
+      return slot.park_until( deadline );
+   }
+} ;
+
+// *****************************************************************************
+//  Waiter
 
-  // register no thread is running in the monitor
-  running = false ;
+Waiter::Waiter()
+:  next( nullptr ),
+   slot( ParkSlot::current() ),
+   thread_id( std::this_thread::get_id() )
+{
+}
 
-  // allow another thread to start or continue running in the monitor, if any is waiting
-  allow_another_to_enter();
+// *****************************************************************************
+//  ThreadQueue (FIFO of waiters)
 
-  // release queues access mutex (destroy 'lock')
+void ThreadsQueue::push( Waiter * w )
+{
+  assert( w != nullptr );
+  w->next = nullptr ;
+  if ( tail == nullptr )
+    head = w ;
+  else
+    tail->next = w ;
+  tail = w ;
+  num_wt += 1 ;       // one more waiting thread
 }
 // -----------------------------------------------------------------------------
-// allow a waiting thread to enter the monitor, if any
 
-void HoareMonitor::allow_another_to_enter()
+Waiter * ThreadsQueue::pop( )
 {
-  if ( 0 < urgent_queue->get_nwt() )  // if any thread in the urgent queue
-     urgent_queue->signal();          //   release one, allow it to enter (remains closed)
-  else                                // if no thread in the urgent
-     monitor_queue->signal();         //   signal the monitor queue
+  Waiter * w = head ;
+  if ( w == nullptr )
+    return nullptr ;
+
+  head = w->next ;
+  if ( head == nullptr )
+    tail = nullptr ;
+  w->next = nullptr ;
+  num_wt -= 1 ;       // one less waiting thread
+  return w ;
 }
+
 // -----------------------------------------------------------------------------
-// wait on a queue
+// remove a waiter from any position in the queue (used on timeouts),
+// returns false if the waiter was not in the queue
 
-void HoareMonitor::wait( unsigned q_index )
+bool ThreadsQueue::remove( Waiter * w )
 {
-   // check this is the thread running in the monitor
-   assert( running );
-   assert( std::this_thread::get_id() == running_thread_id );
+  Waiter * prev = nullptr ;
+  for( Waiter * cur = head ; cur != nullptr ; prev = cur, cur = cur->next )
+  {
+    if ( cur != w )
+      continue ;
+
+    if ( prev == nullptr )
+      head = w->next ;
+    else
+      prev->next = w->next ;
+    if ( tail == w )
+      tail = prev ;
+    w->next = nullptr ;
+    num_wt -= 1 ;     // one less waiting thread
+    return true ;
+  }
+  return false ;
+}
 
-   // check 'q_index' is a valid queue index
-   assert( q_index < queues.size() );
+// *****************************************************************************
+//
+// Monitor statistics
+//
+// Each thread using a monitor with statistics enabled owns a statistics block
+// in that monitor, and only that thread writes in it (the counters are atomic
+// only to allow snapshots from other threads, loads and stores are relaxed).
+// A thread finds its block through a small thread local cache, keyed by the
+// monitor unique identifier (monitor addresses can be reused).
+//
+// *****************************************************************************
 
-   // acquire queues access mutex
-   std::unique_lock<std::mutex> lock( queues_mtx );
+// counter written by a single thread, readable from any thread
 
-   // allow another thread to start or continue running in the monitor, if any is waiting
-   // (that thread, if any, cannot run until this thread releases 'queues_mtx' when this starts waiting)
-   allow_another_to_enter();
+class StatsCounter
+{
+   private:
+   std::atomic<uint64_t> value ;
 
-   // register no thread is running in the monitor
-   running = false ;
+   public:
+   StatsCounter() : value( 0 ) {}
 
-   // blocked wait on the condition threads queue
-   queues[q_index]->wait( lock );
+   uint64_t get() const { return value.load( std::memory_order_relaxed ); }
+   void     add( uint64_t d ) { value.store( get() + d, std::memory_order_relaxed ); }
+   void     max( uint64_t v ) { if ( get() < v ) value.store( v, std::memory_order_relaxed ); }
+} ;
+// -----------------------------------------------------------------------------
+// histogram of durations written by a single thread
 
-   // check the signaling thread did set running to true
-   assert( running );
+class StatsHistogram
+{
+   private:
+   StatsCounter count, sum, max, buckets[Histogram::num_buckets] ;
 
-   // re-enter the monitor: register this is the thread running in the monitor
-   running_thread_id = std::this_thread::get_id();
+   public:
 
-   // release queues access mutex (destroy 'lock')
-}
+   void record( uint64_t ns )
+   {
+      count.add( 1 );
+      sum.add( ns );
+      max.max( ns );
+      buckets[ Histogram::bucket( ns ) ].add( 1 );
+   }
 
+   void read( Histogram & h ) const
+   {
+      h.count  = count.get();
+      h.sum_ns = sum.get();
+      h.max_ns = max.get();
+      for( unsigned b = 0 ; b < Histogram::num_buckets ; b++ )
+         h.buckets[b] = buckets[b].get();
+   }
+} ;
 // -----------------------------------------------------------------------------
-// signal with urgent wait semantics on a user-defined variable condition
+// statistics of a thread on a condition variable
 
-void HoareMonitor::signal( unsigned q_index )
+struct CondVarCounters
 {
-   assert( running );
-   assert( std::this_thread::get_id() == running_thread_id );
-   assert( q_index < queues.size() );
+   StatsCounter   signals, wakeups, timeouts ;
+   StatsHistogram wait ;
+} ;
+// -----------------------------------------------------------------------------
+// statistics of a thread in a monitor
 
-   // wait to get the queues lock, then acquire it.
-   std::unique_lock<std::mutex> lock( queues_mtx );
+class StatsBlock
+{
+   public:
 
-   // does nothing when queue is empty
-   if ( 0 < queues[q_index]->get_nwt() )
-   {
-      // signal a thread in the queue, it cannot run yet
-      queues[q_index]->signal() ;
+   const ThreadIdentity & identity ;      // thread owning this block
 
-      // 1. release queues mutex (allows signalled thread to run),
-      // 2. wait for signalled thread to stop running in the monitor
-      // 3. reacquire de queues lock
-      urgent_queue->wait( lock );
+   StatsCounter   entries, contended_entries ;
+   StatsHistogram entry_wait, hold, urgent ;
 
-      // check that the signalled thread did set 'running' to false when exited or entered a queue)
-      assert( ! running );
+   // one element per condition variable index used by the thread
+   // (a deque does not move its elements, it only grows under 'stats_mtx')
+   std::deque<CondVarCounters> conds ;
 
-      // register this is the running thread
-      running = true ;
-      running_thread_id = std::this_thread::get_id();
-   }
-   // release queues lock (destroy 'lock').
+   // time the thread entered the monitor (0 if not known)
+   uint64_t scope_start ;
+
+   StatsBlock() : identity( ThreadIdentity::current() ), scope_start( 0 ) {}
+} ;
+// -----------------------------------------------------------------------------
+// time stamps for statistics (never 0): the processor time stamp counter
+// where available, several times cheaper than reading the steady clock, and
+// converted to nanoseconds with a rate measured once (see 'stats_calibrate')
+
+static std::atomic<double> stats_ns_per_tick( 1.0 ) ;
+
+static inline uint64_t stats_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   return uint64_t( __rdtsc() ) | 1u ;
+#else
+   return uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch() ).count() ) | 1u ;
+#endif
 }
 // -----------------------------------------------------------------------------
-// returns number of waiting threads in a queue (associated to a user-defined cv)
+// nanoseconds in a number of time stamp ticks, and elapsed since a time stamp
 
-unsigned HoareMonitor::get_nwt( unsigned q_index )
+static inline uint64_t stats_ns( uint64_t ticks )
 {
-  assert( running );
-  assert( std::this_thread::get_id() == running_thread_id );
-  assert( q_index < queues.size() );
+   return uint64_t( double( ticks ) * stats_ns_per_tick.load( std::memory_order_relaxed ) );
+}
 
-  std::unique_lock<std::mutex> lock( queues_mtx );
-  return queues[q_index]->get_nwt() ;
+static inline uint64_t stats_since( uint64_t start )
+{
+   return stats_ns( stats_now() - start );
 }
 // -----------------------------------------------------------------------------
-// register calling thread name in the monitor, useful for debugging
+// measure the time stamp counter rate against the steady clock (takes 2 ms)
 
-void HoareMonitor::register_thread_name( const std::string & rol, const int number )
+static void stats_calibrate()
 {
-  const std::string name = rol + " " + std::to_string(number) ;
-  register_thread_name( name );
+#if defined(__x86_64__) || defined(__i386__)
+   typedef std::chrono::steady_clock clock ;
+   const clock::time_point t0 = clock::now();
+   const uint64_t          c0 = stats_now();
+   clock::time_point       t1 ;
+   do
+      t1 = clock::now();
+   while ( t1 - t0 < std::chrono::milliseconds( 2 ) );
+   const uint64_t c1 = stats_now();
+
+   stats_ns_per_tick.store( std::chrono::duration<double,std::nano>( t1-t0 ).count()
+                            / double( c1-c0 ), std::memory_order_relaxed );
+#endif
 }
+
+static std::once_flag stats_calibrated ;
 // -----------------------------------------------------------------------------
+// source of monitor unique identifiers
 
-void HoareMonitor::register_thread_name( const std::string & name )
+static std::atomic<uint64_t> next_monitor_id( 1 ) ;
+
+// cache of statistics blocks used by this thread, the most recent first
+struct StatsCacheEntry
 {
-  std::unique_lock<std::mutex> lock( names_mtx );
-  // get thread id in ttid
-  const std::thread::id ttid = std::this_thread::get_id() ; // this thread ident.
+   uint64_t     monitor_id ;
+   StatsBlock * block ;
+} ;
 
-  // search and abort if already registered
-  const auto iter = names_map.find( ttid );
-  if ( iter != names_map.end() )
-  {
-    logM("that id was already registered, with name == '" << iter->second << "', aborting");
-    exit(1);
-  }
+static const unsigned stats_cache_size = 8 ;
+static thread_local StatsCacheEntry stats_cache[stats_cache_size] ;
+
+// *****************************************************************************
+//  Histogram and MonitorStats (snapshots)
+
+Histogram::Histogram()
+:  count( 0 ), sum_ns( 0 ), max_ns( 0 )
+{
+   for( unsigned b = 0 ; b < num_buckets ; b++ )
+      buckets[b] = 0 ;
+}
+// -----------------------------------------------------------------------------
+// number of significant bits in 'ns' (the last bucket also holds longer durations)
+
+unsigned Histogram::bucket( uint64_t ns )
+{
+#if defined(__GNUC__)
+   const unsigned b = ns == 0 ? 0 : 64 - unsigned( __builtin_clzll( ns ) );
+#else
+   unsigned b = 0 ;
+   for( uint64_t v = ns ; v != 0 ; v >>= 1 )
+      b++ ;
+#endif
+   return std::min( b, num_buckets-1 );
+}
+// -----------------------------------------------------------------------------
 
-  // insert name
-  names_map.insert( std::pair< std::thread::id, std::string>( ttid, name ) );
+void Histogram::record( uint64_t ns )
+{
+   count++ ;
+   sum_ns += ns ;
+   max_ns  = std::max( max_ns, ns );
+   buckets[ bucket( ns ) ]++ ;
 }
+// -----------------------------------------------------------------------------
 
+void Histogram::add( const Histogram & other )
+{
+   count  += other.count ;
+   sum_ns += other.sum_ns ;
+   max_ns  = std::max( max_ns, other.max_ns );
+   for( unsigned b = 0 ; b < num_buckets ; b++ )
+      buckets[b] += other.buckets[b] ;
+}
 // -----------------------------------------------------------------------------
-// get this thread registered name (or "unknown" if not registered)
-std::string HoareMonitor::get_thread_name()
+
+double Histogram::mean_ns() const
 {
-  std::unique_lock<std::mutex> lock( names_mtx );
+   return count == 0 ? 0.0 : double( sum_ns )/double( count );
+}
+// -----------------------------------------------------------------------------
+// upper bound of the bucket holding the q-th quantile (0 <= q <= 1),
+// never above the maximum duration
 
-  const auto ttid = std::this_thread::get_id() ; // this thread ident.
-  const auto iter = names_map.find( ttid );
+uint64_t Histogram::percentile_ns( double q ) const
+{
+   if ( count == 0 )
+      return 0 ;
+   const uint64_t rank = std::min( count, uint64_t( q*double( count ) ) + 1 );
+   uint64_t       acc  = 0 ;
+   for( unsigned b = 0 ; b < num_buckets ; b++ )
+   {
+      acc += buckets[b] ;
+      if ( rank <= acc )
+         return b == 0 ? 0 : std::min( max_ns, ( uint64_t(1) << b ) - 1 );
+   }
+   return max_ns ;
+}
+// -----------------------------------------------------------------------------
 
-  if ( iter != names_map.end() )
-    return iter->second ;
-  else
-    return "(unknown)" ;
+void MonitorStats::add( const MonitorStats & other )
+{
+   entries           += other.entries ;
+   contended_entries += other.contended_entries ;
+   entry_wait.add( other.entry_wait );
+   hold.add( other.hold );
+   urgent.add( other.urgent );
 
+   for( const CondVarStats & oc : other.conds )
+   {
+      auto it = std::find_if( conds.begin(), conds.end(),
+                  [&oc]( const CondVarStats & c ) { return c.index == oc.index ; } );
+      if ( it == conds.end() )
+      {
+         conds.push_back( oc );
+         continue ;
+      }
+      it->signals  += oc.signals ;
+      it->wakeups  += oc.wakeups ;
+      it->timeouts += oc.timeouts ;
+      it->wait.add( oc.wait );
+   }
+   std::sort( conds.begin(), conds.end(),
+      []( const CondVarStats & a, const CondVarStats & b ) { return a.index < b.index ; } );
 }
 
+// *****************************************************************************
+//
+// Monitor events trace (only with TRAZA_M defined)
+//
+// Every thread owns a ring buffer, created on its first event and never
+// freed (the buffers of finished threads are still written to the file).
+// Only the owner thread writes in its buffer, so recording an event is a
+// time stamp, a few stores and a release store of the buffer head.
+// The file is written with 'open' and 'write' calls only, so it can be
+// written from a signal handler (records being overwritten while the file is
+// written can be garbled, so the oldest records are skipped when the buffer
+// has wrapped around).
+//
+// *****************************************************************************
+
+#ifdef TRAZA_M
+
+// records per thread buffer (a power of two)
+#ifndef TRAZA_M_REGISTROS
+#define TRAZA_M_REGISTROS 65536
+#endif
+
+static const uint64_t trace_capacity     = TRAZA_M_REGISTROS ,
+                      trace_skip         = 64 ;   // skipped when wrapped around
+static const unsigned trace_max_threads  = 1024 ,
+                      trace_max_monitors = 1024 ;
+
+static_assert( ( trace_capacity & ( trace_capacity-1 ) ) == 0 && trace_skip < trace_capacity,
+               "TRAZA_M_REGISTROS must be a power of two, at least 128" );
+
+class TraceBuffer
+{
+   public:
+   std::atomic<uint64_t> head ;      // number of records written so far
+   TraceThreadEntry      entry ;     // thread number and name
+   TraceRecord           records[trace_capacity] ;
+} ;
 
+// buffers and monitors entries, appended under 'trace_mtx'
+// (read without the lock when writing the file)
+static std::atomic<TraceBuffer *> trace_buffers[trace_max_threads] ;
+static std::atomic<unsigned>      trace_num_buffers( 0 ) ;
+static TraceMonitorEntry          trace_monitors[trace_max_monitors] ;
+static std::atomic<unsigned>      trace_num_monitors( 0 ) ;
+static std::mutex                 trace_mtx ;
 
+// trace file name, and buffer of the calling thread
+static char                       trace_path[256] = "traza_m.bin" ;
+static std::once_flag             trace_installed ;
+static thread_local TraceBuffer * trace_buffer = nullptr ;
+
+// -----------------------------------------------------------------------------
+// write a block of bytes, returns false on error
+
+static bool trace_write_all( int fd, const void * data, size_t size )
+{
+   const char * p = static_cast<const char *>( data );
+   while ( 0 < size )
+   {
+      const ssize_t n = ::write( fd, p, size );
+      if ( n <= 0 )
+         return false ;
+      p    += n ;
+      size -= size_t( n );
+   }
+   return true ;
+}
+// -----------------------------------------------------------------------------
+
+bool trace_dump( const char * path )
+{
+   const int fd = ::open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+   if ( fd < 0 )
+      return false ;
+
+   TraceFileHeader header ;
+   std::memcpy( header.magic, trace_magic, sizeof( header.magic ) );
+   header.ns_per_tick  = stats_ns_per_tick.load( std::memory_order_relaxed );
+   header.num_monitors = std::min( trace_num_monitors.load(), trace_max_monitors );
+   header.num_threads  = trace_num_buffers.load();
+
+   bool ok = trace_write_all( fd, &header, sizeof( header ) )
+          && trace_write_all( fd, trace_monitors, header.num_monitors*sizeof( TraceMonitorEntry ) );
+
+   for( unsigned i = 0 ; ok && i < header.num_threads ; i++ )
+   {
+      const TraceBuffer * b     = trace_buffers[i].load( std::memory_order_acquire );
+      const uint64_t      head  = b->head.load( std::memory_order_acquire ),
+                          num   = head <= trace_capacity ? head : trace_capacity-trace_skip ,
+                          first = ( head-num ) & ( trace_capacity-1 ),
+                          part  = std::min( num, trace_capacity-first );
+      TraceThreadEntry    entry = b->entry ;
+
+      entry.num_records = uint32_t( num );
+      ok = trace_write_all( fd, &entry, sizeof( entry ) )
+        && trace_write_all( fd, b->records+first, part*sizeof( TraceRecord ) )
+        && trace_write_all( fd, b->records, ( num-part )*sizeof( TraceRecord ) );
+   }
+   ::close( fd );
+   return ok ;
+}
+// -----------------------------------------------------------------------------
+
+static void trace_at_exit()
+{
+   trace_dump( trace_path );
+}
+// -----------------------------------------------------------------------------
+// write the file and terminate as the signal would have done
+
+static void trace_on_signal( int sig )
+{
+   trace_dump( trace_path );
+   std::signal( sig, SIG_DFL );
+   std::raise( sig );
+}
+// -----------------------------------------------------------------------------
+
+static void trace_install()
+{
+   const char * path = std::getenv( "TRAZA_M_FICHERO" );
+   if ( path != nullptr )
+   {
+      std::strncpy( trace_path, path, sizeof( trace_path )-1 );
+      trace_path[sizeof( trace_path )-1] = 0 ;
+   }
+   std::call_once( stats_calibrated, stats_calibrate );
+   std::atexit( trace_at_exit );
+   std::signal( SIGINT,  trace_on_signal );
+   std::signal( SIGTERM, trace_on_signal );
+}
+// -----------------------------------------------------------------------------
+// buffer of the calling thread (nullptr if there are too many threads)
+
+static TraceBuffer * trace_thread_buffer()
+{
+   if ( trace_buffer != nullptr )
+      return trace_buffer ;
+
+   std::call_once( trace_installed, trace_install );
+   std::unique_lock<std::mutex> lock( trace_mtx );
+
+   const unsigned num = trace_num_buffers.load( std::memory_order_relaxed );
+   if ( trace_max_threads <= num )
+      return nullptr ;
+
+   TraceBuffer * b = new TraceBuffer ;
+   b->head.store( 0, std::memory_order_relaxed );
+   b->entry.thread      = num ;
+   b->entry.num_records = 0 ;
+   std::snprintf( b->entry.name, trace_name_size, "hebra %u", num );
+
+   trace_buffers[num].store( b, std::memory_order_release );
+   trace_num_buffers.store( num+1, std::memory_order_release );
+   trace_buffer = b ;
+   return b ;
+}
+// -----------------------------------------------------------------------------
+
+static void trace_record( uint64_t monitor, TraceEventKind kind, unsigned cond, unsigned arg )
+{
+   TraceBuffer * b = trace_thread_buffer();
+   if ( b == nullptr )
+      return ;
+
+   const uint64_t h = b->head.load( std::memory_order_relaxed );
+   TraceRecord &  r = b->records[ h & ( trace_capacity-1 ) ] ;
+   r.ticks    = stats_now();
+   r.monitor  = uint32_t( monitor );
+   r.arg      = uint32_t( arg );
+   r.kind     = uint16_t( kind );
+   r.cond     = uint16_t( cond );
+   r.reserved = 0 ;
+   b->head.store( h+1, std::memory_order_release );
+}
+// -----------------------------------------------------------------------------
+
+static void trace_set_thread_name( const std::string & name )
+{
+   TraceBuffer * b = trace_thread_buffer();
+   if ( b != nullptr )
+      std::snprintf( b->entry.name, trace_name_size, "%s", name.c_str() );
+}
+// -----------------------------------------------------------------------------
+
+static void trace_register_monitor( uint64_t monitor, const std::string & name )
+{
+   std::call_once( trace_installed, trace_install );
+   std::unique_lock<std::mutex> lock( trace_mtx );
+
+   const unsigned num = trace_num_monitors.load( std::memory_order_relaxed );
+   if ( trace_max_monitors <= num )
+      return ;
+
+   trace_monitors[num].monitor  = uint32_t( monitor );
+   trace_monitors[num].reserved = 0 ;
+   std::snprintf( trace_monitors[num].name, trace_name_size, "%s", name.c_str() );
+   trace_num_monitors.store( num+1, std::memory_order_release );
+}
+
+// record an event of this monitor, in the calling thread buffer
+#define traceM( kind, cond, arg ) trace_record( monitor_id, kind, cond, arg )
+
+#else
+
+#define traceM( kind, cond, arg )
+
+#endif // TRAZA_M
+
+// *****************************************************************************
+//
+// Class: MonitorBase
+//
+// *****************************************************************************
+
+// monitor left by this thread before the end of the running procedure
+// (the next 'leave' on that monitor is done by the call proxy, and it is skipped)
+static thread_local MonitorBase * left_early_monitor = nullptr ;
+
+// monitor whose combined call, published by another thread, this thread is
+// running: a wait in it throws CombinedCallWaits, and the call is given back
+// to its thread (see 'run_published_calls'), which must find it unchanged,
+// so it cannot signal before waiting
+static thread_local MonitorBase * combining_monitor = nullptr ;
+static thread_local bool          combined_call_signalled = false ;
+
+struct CombinedCallWaits {} ;
+
+static void combined_call_waits()
+{
+   assert( ! combined_call_signalled ); // (a combined call cannot signal before waiting)
+   throw CombinedCallWaits();
+}
+
+// publication list of combined calls: a fixed number of slots, shared by the
+// threads whose identifiers map to the same one (a thread which finds its
+// slot taken just makes a normal call), and 'used' is one past the highest
+// slot used so far: combiners only scan those.
+// A published call is taken by exchanging its slot to null, either by a
+// combiner (the thread in the monitor, when it leaves) or by its own thread
+// once it gets the monitor, so it runs exactly once.
+
+static const unsigned max_combine_slots = 64 ;
+
+struct CombineSlots
+{
+   std::atomic<CombinedCall *> slot[max_combine_slots] ;
+   std::atomic<unsigned>       used ;
+
+   CombineSlots() : used( 0 )
+   {
+      for( auto & s : slot )
+         s.store( nullptr, std::memory_order_relaxed );
+   }
+} ;
+
+// status of a combined call: still published, run by a combiner, or given
+// back to its thread (it had to wait)
+static const unsigned call_pending = 0, call_done = 1, call_retry = 2 ;
+
+// executor of the asynchronous calls of a monitor (see MRef::async): a thread
+// serving a queue of calls (Vyukov MPSC, as in AsyncLog), which sleeps in its
+// ParkSlot when the queue is empty. Producers unpark it only after taking the
+// 'sleeping' flag, so a single unpark matches each park (the slot is also
+// used by the waits inside the calls).
+// The executor is stopped by the monitor destructor. If that runs in the
+// executor thread itself (the last reference was held by a call), or in a
+// thread taking part in a simulation (joining it would block the simulation),
+// the thread is detached and it deletes the executor when it ends.
+
+class MonitorExecutor
+{
+   public:
+
+   explicit MonitorExecutor( MonitorBase & p_monitor );
+
+   void submit( std::shared_ptr<AsyncCall> && call );
+   void stop();
+
+   private:
+
+   struct Node
+   {
+      std::atomic<Node *>        next ;
+      std::shared_ptr<AsyncCall> call ;
+
+      Node() : next( nullptr ) {}
+   } ;
+
+   MonitorBase &             monitor ;
+
+   // producers exchange 'head', the executor owns 'tail' (a consumed node)
+   // (padded apart: 'new' does not align to a cache line in C++11)
+   std::atomic<Node *>       head ;
+   char                      head_line[cache_line_size] ;
+   Node *                    tail ;
+
+   std::atomic<bool>         sleeping ;   // the executor is (about to be) parked
+   std::atomic<bool>         stopping ;
+   bool                      detached ;   // the thread deletes the executor
+   ParkSlot *                slot ;       // (of the executor thread)
+   std::thread               thread ;
+
+   ~MonitorExecutor();
+
+   Node * pop();   // executor only: next node (or nullptr)
+   void   run();   // executor thread body
+} ;
+
+// status of an asynchronous call: in the queue (or running), in the queue
+// with a thread waiting for it, or done
+static const unsigned async_queued = 0, async_waited = 1, async_done = 2 ;
+
+// default maximum number of spin iterations in 'enter'
+// (no spinning at all on a single processor, the running thread cannot progress)
+static const unsigned default_spin_limit = std::thread::hardware_concurrency() > 1 ? 200 : 0 ;
+
+
+void MonitorBase::initialize()
+{
+   state           = 0 ;
+   spin_limit      = default_spin_limit ;
+   spin_budget     = default_spin_limit/2 ;
+   stats_enabled   = false ;
+   combine_slots   = nullptr ;
+   executor        = nullptr ;
+   monitor_id      = next_monitor_id++ ;
+   //reference_count = 0 ;
+}
+// -----------------------------------------------------------------------------
+MonitorBase::MonitorBase()
+{
+   name = "unknown" ;
+   initialize();
+#ifdef TRAZA_M
+   trace_register_monitor( monitor_id, name );
+#endif
+}
+// -----------------------------------------------------------------------------
+
+MonitorBase::MonitorBase( const std::string & p_name )
+{
+   name = p_name ;
+   initialize();
+#ifdef TRAZA_M
+   trace_register_monitor( monitor_id, name );
+#endif
+}
+// -----------------------------------------------------------------------------
+MonitorBase::~MonitorBase()
+{
+   //cout << "starts monitor destructor" << endl ;
+
+   if ( executor.load() != nullptr )
+      executor.load()->stop();
+
+   assert( ! is_running() );
+
+   assert( urgent_queue.get_nwt() == 0 );
+   assert( monitor_queue.get_nwt() == 0 );
+
+   delete combine_slots.load();
+
+   //cout << "ends monitor destructor" << endl ;
+}
+// -----------------------------------------------------------------------------
+// enter the monitor, waiting if neccesary
+
+void MonitorBase::enter()
+{
+  const bool stats = stats_enabled.load( std::memory_order_relaxed );
+
+  // fast path: the monitor is free and nobody is waiting for it
+  if ( try_enter() )
+  {
+    traceM( trace_enter, 0, 0 );
+    if ( stats )
+      stats_entered( 0 );
+    return ;
+  }
+
+  traceM( trace_enter_request, 0, 0 );
+  const uint64_t wait_start = stats ? stats_now() : 0 ;
+  enter_contended();
+  traceM( trace_enter, 0, 1 );
+  if ( stats )
+    stats_entered( wait_start );
+}
+// -----------------------------------------------------------------------------
+// enter the monitor when it is running or somebody is queued: spin for a
+// while, then wait in the monitor queue
+
+void MonitorBase::enter_contended()
+{
+  // spin for a while if the monitor is running: it is usually held for a short time
+  // (not in a simulation: the running thread cannot progress while spinning)
+  if ( 0 < spin_limit.load( std::memory_order_relaxed ) && ! VirtualTime::active()
+       && spin_until_free() )
+    return ;
+
+  Waiter me ;
+
+  {
+    // acquire queues access mutex
+    std::unique_lock<std::mutex> lock( queues_mtx );
+
+    // the monitor is free: this thread is now running in it
+    if ( acquire_or_queue( me ) )
+      return ;
+
+    // release queues access mutex (destroy 'lock')
+  }
+
+  // wait until the monitor is handed over to this thread
+  me.park();
+  assert( is_running() );
+  assert( running_thread_id == me.thread_id );
+}
+// -----------------------------------------------------------------------------
+// register this thread as the running one if the monitor is free (returns
+// true), otherwise put the waiter in the monitor queue (returns false)
+// (the caller must hold 'queues_mtx')
+
+bool MonitorBase::acquire_or_queue( Waiter & me )
+{
+  unsigned s = state.load( std::memory_order_relaxed );
+  for( ;; )
+  {
+    // the monitor is free: register this thread is running in the monitor
+    if ( ( s & running ) == 0 )
+    {
+      if ( state.compare_exchange_weak( s, s | running, std::memory_order_acquire ) )
+      {
+        running_thread_id = me.thread_id ;
+        return true ;
+      }
+    }
+    // other thread is running the monitor: announce this thread queues up,
+    // so the running thread takes the slow path when leaving
+    else if ( state.compare_exchange_weak( s, s | queued, std::memory_order_relaxed ) )
+      break ;
+  }
+
+  // queue up
+  monitor_queue.push( &me );
+  return false ;
+}
+// -----------------------------------------------------------------------------
+// enter the monitor if it is free and no thread is queued, without blocking
+
+bool MonitorBase::try_enter()
+{
+  unsigned expected = 0 ;
+  if ( ! state.compare_exchange_strong( expected, running, std::memory_order_acquire ) )
+    return false ;
+
+  running_thread_id = std::this_thread::get_id();
+  return true ;
+}
+// -----------------------------------------------------------------------------
+
+bool MonitorBase::is_running() const
+{
+  return ( state.load( std::memory_order_relaxed ) & running ) != 0 ;
+}
+// -----------------------------------------------------------------------------
+// spin (without holding 'queues_mtx') while the monitor is running, and try to
+// enter it as soon as it is free (returns true if entered)
+//
+// the number of iterations adapts to the hold times, as in glibc adaptive
+// mutexes: the budget is a moving average of the iterations needed to get
+// the monitor, and at most twice that (plus a margin) is spent spinning
+
+bool MonitorBase::spin_until_free()
+{
+  const unsigned limit  = spin_limit.load( std::memory_order_relaxed ),
+                 budget = spin_budget.load( std::memory_order_relaxed ),
+                 max_it = std::min( limit, 2*budget + 10 );
+  unsigned       it     = 0 ;
+  bool           got    = false ;
+
+  while ( it < max_it )
+  {
+    // queued threads go first: spinning is useless
+    const unsigned s = state.load( std::memory_order_relaxed );
+    if ( s & queued )
+      break ;
+    if ( s == 0 && try_enter() )
+    {
+      got = true ;
+      break ;
+    }
+    cpu_relax();
+    it++ ;
+  }
+
+  // update the moving average (races between spinners are harmless)
+  const unsigned new_budget = unsigned( int(budget) + ( int(it) - int(budget) )/8 ) ;
+  spin_budget.store( std::min( new_budget, limit ), std::memory_order_relaxed );
+
+  return got ;
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::set_spin_limit( unsigned max_spins )
+{
+  spin_limit.store( max_spins, std::memory_order_relaxed );
+  spin_budget.store( max_spins/2, std::memory_order_relaxed );
+}
+// -----------------------------------------------------------------------------
+
+unsigned MonitorBase::get_spin_limit() const
+{
+  return spin_limit.load( std::memory_order_relaxed );
+}
+// -----------------------------------------------------------------------------
+// end running monitor code
+
+void MonitorBase::leave()
+{
+  // the procedure already left the monitor (see 'leave_early')
+  if ( left_early_monitor == this )
+  {
+    left_early_monitor = nullptr ;
+    return ;
+  }
+
+  // check this is the thread running in the monitor
+  assert( is_running() );
+  assert( std::this_thread::get_id() == running_thread_id );
+
+  // run the calls published by other threads before handing the monitor on
+  // (see MRef::combine), unless this is one of them
+  CombineSlots * const slots = combine_slots.load( std::memory_order_acquire );
+  if ( slots != nullptr && combining_monitor != this )
+    run_published_calls( *slots );
+
+  if ( stats_enabled.load( std::memory_order_relaxed ) )
+    stats_leaving();
+  traceM( trace_leave, 0, 0 );
+
+  // fast path: nobody is queued, just free the monitor
+  unsigned expected = running ;
+  if ( state.compare_exchange_strong( expected, 0, std::memory_order_release ) )
+    return ;
+
+  Waiter * next ;
+
+  {
+    // acquire queues access mutex
+    std::unique_lock<std::mutex> lock( queues_mtx );
+
+    // allow another thread to start or continue running in the monitor, if any is waiting
+    // (otherwise, register no thread is running in the monitor)
+    next = allow_another_to_enter();
+
+    // release queues access mutex (destroy 'lock')
+  }
+
+  // wake up the new running thread, if any (outside the queues lock)
+  if ( next != nullptr )
+    next->unpark();
+}
+// -----------------------------------------------------------------------------
+// leave the monitor before the procedure ends (after the last monitor
+// operation), the proxy 'leave' call at the end of the procedure is skipped
+
+void MonitorBase::leave_early()
+{
+  if ( combining_monitor == this )   // (a combiner keeps the monitor, see 'run_published_calls')
+    return ;
+  leave();
+  assert( left_early_monitor == nullptr );
+  left_early_monitor = this ;
+}
+// -----------------------------------------------------------------------------
+// hand the monitor over to a waiter, which will be waked up already owning it
+// (the caller must hold 'queues_mtx', and the waiter must be out of any queue;
+// the waiter must be unparked later, preferably after releasing 'queues_mtx')
+
+Waiter * MonitorBase::hand_over( Waiter * w )
+{
+  assert( w != nullptr );
+  assert( is_running() );
+
+  // the monitor remains running, 'queued' must reflect the queues contents
+  const bool any_queued = 0 < urgent_queue.get_nwt() || 0 < monitor_queue.get_nwt() ;
+  state.store( any_queued ? running | queued : running, std::memory_order_release );
+  running_thread_id = w->thread_id ;
+  return w ;
+}
+// -----------------------------------------------------------------------------
+// allow a waiting thread to enter the monitor, if any
+// (the caller must hold 'queues_mtx' and own the monitor, which it loses)
+// returns the waiter which now owns the monitor (to be unparked), or nullptr
+
+Waiter * MonitorBase::allow_another_to_enter()
+{
+  Waiter * w = urgent_queue.pop();  // threads in the urgent queue go first
+  if ( w == nullptr )
+     w = monitor_queue.pop();       // then threads in the monitor queue
+
+  if ( w != nullptr )
+     return hand_over( w );          // the monitor remains running
+
+  // no thread waiting: free the monitor
+  // (nobody else can modify the state: the monitor is running and 'queues_mtx' is held)
+  state.store( 0, std::memory_order_release );
+  return nullptr ;
+}
+// -----------------------------------------------------------------------------
+// wait on a queue
+
+void MonitorBase::wait( ThreadsQueue & queue )
+{
+   // check this is the thread running in the monitor
+   assert( is_running() );
+   assert( std::this_thread::get_id() == running_thread_id );
+
+   // a combined call run by another thread is given back instead (see MRef::combine)
+   if ( combining_monitor == this )
+     combined_call_waits();
+
+   const uint64_t wait_start = stats_enabled.load( std::memory_order_relaxed ) ? stats_now() : 0 ;
+   Waiter me ;
+   Waiter * next ;
+   traceM( trace_wait, queue.get_index(), 0 );
+
+   {
+     // acquire queues access mutex
+     std::unique_lock<std::mutex> lock( queues_mtx );
+
+     // enter the condition threads queue
+     queue.push( &me );
+
+     // allow another thread to start or continue running in the monitor, if any is waiting
+     next = allow_another_to_enter();
+
+     // release queues access mutex (destroy 'lock')
+   }
+
+   if ( next != nullptr )
+     next->unpark();
+
+   // blocked wait until a signaling thread hands the monitor over to this thread
+   me.park();
+
+   // check the signaling thread did register this thread as the running one
+   assert( is_running() );
+   assert( running_thread_id == me.thread_id );
+   traceM( trace_resume, queue.get_index(), 0 );
+
+   if ( wait_start != 0 )
+     stats_waited( queue, wait_start, true );
+}
+
+// -----------------------------------------------------------------------------
+// wait on a queue until signalled or until a deadline has passed
+// returns true if signalled, false on timeout; in both cases the calling
+// thread owns the monitor again on return (on timeout, the thread leaves the
+// condition queue and waits in the monitor queue to re-enter)
+
+bool MonitorBase::wait_until( ThreadsQueue & queue,
+                              const std::chrono::steady_clock::time_point & deadline )
+{
+   // check this is the thread running in the monitor
+   assert( is_running() );
+   assert( std::this_thread::get_id() == running_thread_id );
+
+   if ( combining_monitor == this )
+     combined_call_waits();
+
+   const uint64_t wait_start = stats_enabled.load( std::memory_order_relaxed ) ? stats_now() : 0 ;
+   Waiter me ;
+   Waiter * next ;
+   traceM( trace_wait, queue.get_index(), 0 );
+
+   {
+     // acquire queues access mutex
+     std::unique_lock<std::mutex> lock( queues_mtx );
+
+     // enter the condition threads queue, and allow another thread to run
+     queue.push( &me );
+     next = allow_another_to_enter();
+
+     // release queues access mutex (destroy 'lock')
+   }
+
+   if ( next != nullptr )
+     next->unpark();
+
+   // blocked wait until signalled (the monitor is handed over) or timeout
+   bool signalled = me.park_until( deadline );
+
+   if ( ! signalled )
+   {
+     bool must_park ;
+
+     {
+       // acquire queues access mutex
+       std::unique_lock<std::mutex> lock( queues_mtx );
+
+       // if still in the condition queue, leave it and re-enter the monitor
+       // (otherwise, the thread was signalled just after the timeout)
+       signalled = ! queue.remove( &me );
+       must_park = signalled || ! acquire_or_queue( me );
+
+       // release queues access mutex (destroy 'lock')
+     }
+
+     // wait until the monitor is handed over to this thread
+     if ( must_park )
+       me.park();
+   }
+
+   assert( is_running() );
+   assert( running_thread_id == me.thread_id );
+   traceM( signalled ? trace_resume : trace_timeout, queue.get_index(), 0 );
+
+   if ( wait_start != 0 )
+     stats_waited( queue, wait_start, signalled );
+   return signalled ;
+}
+// -----------------------------------------------------------------------------
+// signal with urgent wait semantics on a user-defined variable condition
+
+void MonitorBase::signal_urgent( ThreadsQueue & queue )
+{
+   assert( is_running() );
+   assert( std::this_thread::get_id() == running_thread_id );
+   if ( combining_monitor == this )
+     combined_call_signalled = true ;
+
+   Waiter me ;
+   Waiter * w ;
+
+   {
+     // wait to get the queues lock, then acquire it.
+     std::unique_lock<std::mutex> lock( queues_mtx );
+
+     // 1. enter the urgent queue (which makes the monitor 'queued'),
+     // 2. hand the monitor over to the signalled thread
+     w = queue.pop() ;
+     if ( w != nullptr )
+     {
+       urgent_queue.push( &me );
+       hand_over( w );
+     }
+
+     // release queues lock (destroy 'lock').
+   }
+
+   const bool     stats        = stats_enabled.load( std::memory_order_relaxed );
+   const uint64_t urgent_start = stats ? stats_now() : 0 ;
+   if ( stats )
+     stats_signalled( queue, w == nullptr ? 0 : 1 );
+   traceM( trace_signal, queue.get_index(), w == nullptr ? 0 : 1 );
+
+   // does nothing when queue is empty
+   if ( w == nullptr )
+     return ;
+   traceM( trace_urgent, 0, 0 );
+
+   // wake up the signalled thread, it can run as soon as it is waked up
+   w->unpark();
+
+   // wait for signalled thread to stop running in the monitor, which hands it back
+   me.park();
+   assert( is_running() );
+   assert( running_thread_id == me.thread_id );
+   traceM( trace_urgent_resume, 0, 0 );
+
+   if ( stats )
+     stats_urgent( urgent_start );
+}
+// -----------------------------------------------------------------------------
+// signal with urgent wait semantics and leave: the monitor is handed over to
+// the signalled thread, and this thread does not enter the urgent queue
+// (if nobody is waiting in the condition, this just leaves the monitor)
+
+void MonitorBase::signal_urgent_and_leave( ThreadsQueue & queue )
+{
+   assert( is_running() );
+   assert( std::this_thread::get_id() == running_thread_id );
+   if ( combining_monitor == this )
+   {
+     signal_urgent( queue );   // (a combiner keeps the monitor, see 'run_published_calls')
+     return ;
+   }
+
+   const bool stats = stats_enabled.load( std::memory_order_relaxed );
+   if ( stats )
+     stats_leaving();
+
+   Waiter * next ;
+   bool     woken ;
+
+   {
+     // acquire queues access mutex
+     std::unique_lock<std::mutex> lock( queues_mtx );
+
+     // the signalled thread gets the monitor, otherwise the usual leave
+     next  = queue.pop() ;
+     woken = next != nullptr ;
+     if ( next != nullptr )
+       hand_over( next );
+     else
+       next = allow_another_to_enter();
+
+     // release queues access mutex (destroy 'lock')
+   }
+
+   // (recorded before the next thread can run)
+   traceM( trace_signal, queue.get_index(), woken ? 1 : 0 );
+   traceM( trace_leave, 0, 0 );
+
+   if ( next != nullptr )
+     next->unpark();
+
+   if ( stats )
+     stats_signalled( queue, woken ? 1 : 0 );
+
+   assert( left_early_monitor == nullptr );
+   left_early_monitor = this ;
+}
+// -----------------------------------------------------------------------------
+// signal with "signal and continue" semantics on a user-defined variable condition:
+// the first waiting thread (or all of them) is moved to the monitor queue,
+// it will get the monitor when this thread (or a later one) leaves
+
+void MonitorBase::signal_continue( ThreadsQueue & queue, bool all )
+{
+   assert( is_running() );
+   assert( std::this_thread::get_id() == running_thread_id );
+   if ( combining_monitor == this )
+     combined_call_signalled = true ;
+
+   unsigned moved = 0 ;
+
+   {
+      // acquire queues access mutex
+      std::unique_lock<std::mutex> lock( queues_mtx );
+
+      while ( Waiter * w = queue.pop() )
+      {
+         monitor_queue.push( w );
+         moved++ ;
+         if ( ! all )
+            break ;
+      }
+
+      // the monitor is now 'queued': the running thread must hand it over on leave
+      // (nobody else can modify the state: the monitor is running and 'queues_mtx' is held)
+      if ( 0 < moved )
+         state.store( running | queued, std::memory_order_relaxed );
+
+      // release queues access mutex (destroy 'lock')
+   }
+
+   if ( stats_enabled.load( std::memory_order_relaxed ) )
+      stats_signalled( queue, moved );
+   traceM( trace_signal, queue.get_index(), moved );
+}
+// -----------------------------------------------------------------------------
+// returns number of waiting threads in a queue (associated to a user-defined cv)
+
+unsigned MonitorBase::get_nwt( ThreadsQueue & queue )
+{
+  assert( is_running() );
+  assert( std::this_thread::get_id() == running_thread_id );
+
+  std::unique_lock<std::mutex> lock( queues_mtx );
+  return queue.get_nwt() ;
+}
+// -----------------------------------------------------------------------------
+// register calling thread name, useful for debugging
+
+void MonitorBase::register_thread_name( const std::string & rol, const int number )
+{
+  const std::string name = rol + " " + std::to_string(number) ;
+  register_thread_name( name );
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::register_thread_name( const std::string & name )
+{
+  ThreadIdentity & me = ThreadIdentity::current() ;
+
+  // abort if already registered with another name
+  if ( ! me.set_name( name ) )
+  {
+    logM("this thread was already registered, with name == '" << me.name() << "', aborting");
+    exit(1);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// get this thread registered name (or "(unknown)" if not registered)
+
+const std::string & MonitorBase::get_thread_name()
+{
+  return ThreadIdentity::current().name() ;
+}
+
+
+// *****************************************************************************
+//  MonitorBase: combined calls
+
+CombineSlots & MonitorBase::get_combine_slots()
+{
+  CombineSlots * slots = combine_slots.load( std::memory_order_acquire );
+  if ( slots != nullptr )
+    return *slots ;
+
+  CombineSlots * created = new CombineSlots() ;
+  if ( combine_slots.compare_exchange_strong( slots, created, std::memory_order_acq_rel ) )
+    return *created ;
+  delete created ;   // created by another thread meanwhile
+  return *slots ;
+}
+// -----------------------------------------------------------------------------
+// publish the call and wait while another thread runs in the monitor, which
+// runs it when leaving: spinning for a while, then blocked in the monitor
+// queue, from which the combiner removes this thread once the call is done.
+// If nobody runs it, or it had to wait, enter the monitor and run it here,
+// as a normal call.
+
+void MonitorBase::call_combined( CombinedCall & call )
+{
+  CombineSlots &                slots = get_combine_slots();
+  const unsigned                index = ThreadIdentity::current().id() % max_combine_slots ;
+  std::atomic<CombinedCall *> & mine  = slots.slot[index] ;
+
+  call.status.store( call_pending, std::memory_order_relaxed );
+  call.waiter = nullptr ;
+  CombinedCall * expected  = nullptr ;
+  const bool     published = mine.compare_exchange_strong( expected, &call, std::memory_order_release,
+                                                           std::memory_order_relaxed );
+  if ( ! published )
+  {
+    enter();
+    call.invoke( call.callable );
+    leave();
+    return ;
+  }
+
+  unsigned used = slots.used.load( std::memory_order_relaxed );
+  while ( used <= index && ! slots.used.compare_exchange_weak( used, index+1, std::memory_order_relaxed ) )
+    ;
+
+  // (no spinning in a simulation: the running thread cannot progress)
+  const unsigned limit = VirtualTime::active() ? 0 : spin_limit.load( std::memory_order_relaxed );
+  for( unsigned it = 0 ; ; it++ )
+  {
+    const unsigned status = call.status.load( std::memory_order_acquire );
+    if ( status == call_done )
+      return ;
+    if ( status == call_retry || limit <= it || state.load( std::memory_order_relaxed ) == 0 )
+      break ;
+    cpu_relax();
+  }
+
+  Waiter me ;                                 // (it lives as long as the call)
+  if ( ! enter_combined( call, me ) )
+    return ;                                  // done by a combiner
+
+  // withdraw the call: if a combiner took it, it gave it back (a call done
+  // by a combiner is marked before the monitor is released)
+  expected = &call ;
+  if ( ! mine.compare_exchange_strong( expected, nullptr, std::memory_order_acquire ) )
+    assert( call.status.load( std::memory_order_acquire ) == call_retry );
+
+  call.invoke( call.callable );               // (it may wait, as any call)
+  leave();
+}
+// -----------------------------------------------------------------------------
+// enter the monitor to run a published call, unless a combiner runs it
+// meanwhile: then returns false, without entering ('me' is the waiter of the
+// calling thread if it has to be queued)
+
+bool MonitorBase::enter_combined( CombinedCall & call, Waiter & me )
+{
+  const bool stats = stats_enabled.load( std::memory_order_relaxed );
+
+  if ( try_enter() )
+  {
+    traceM( trace_enter, 0, 0 );
+    if ( stats )
+      stats_entered( 0 );
+    if ( call.status.load( std::memory_order_acquire ) != call_done )
+      return true ;
+    leave();                                  // done by the previous thread in the monitor
+    return false ;
+  }
+
+  traceM( trace_enter_request, 0, 0 );
+  const uint64_t wait_start = stats ? stats_now() : 0 ;
+  bool           entered ;
+
+  {
+    // acquire queues access mutex
+    std::unique_lock<std::mutex> lock( queues_mtx );
+
+    // (the combiner marks the call holding this mutex)
+    if ( call.status.load( std::memory_order_acquire ) == call_done )
+      return false ;
+    entered = acquire_or_queue( me );
+    if ( ! entered )
+      call.waiter = &me ;
+
+    // release queues access mutex (destroy 'lock')
+  }
+
+  if ( ! entered )
+  {
+    // wait until the monitor is handed over to this thread, or the call is done
+    me.park();
+    call.waiter = nullptr ;                   // (nobody else uses it now)
+    if ( call.status.load( std::memory_order_acquire ) == call_done )
+      return false ;
+    assert( is_running() );
+    assert( running_thread_id == me.thread_id );
+  }
+
+  traceM( trace_enter, 0, 1 );
+  if ( stats )
+    stats_entered( wait_start );
+  return true ;
+}
+// -----------------------------------------------------------------------------
+// (a 'signal_and_leave' in a call run here does not leave the monitor, which
+// must be owned until the call is marked: it signals as 'signal', as the
+// procedure does nothing else after it)
+
+void MonitorBase::run_published_calls( CombineSlots & slots )
+{
+  const unsigned used = slots.used.load( std::memory_order_relaxed );
+  for( unsigned i = 0 ; i < used ; i++ )
+  {
+    if ( slots.slot[i].load( std::memory_order_relaxed ) == nullptr )
+      continue ;
+    CombinedCall * call = slots.slot[i].exchange( nullptr, std::memory_order_acquire );
+    if ( call == nullptr )
+      continue ;
+
+    // (the actions deferred by the call go to its own thread, which runs
+    // them after 'call_combined' returns; those of a call given back are
+    // dropped: they are registered again when it is run again)
+    DeferredActions &   deferred = DeferredActions::current() ;
+    const unsigned      mark     = deferred.size() ;
+    MonitorBase * const previous = combining_monitor ;
+    bool                waits    = false ;
+    combining_monitor       = this ;
+    combined_call_signalled = false ;
+    try
+    {
+      call->invoke( call->callable );
+    }
+    catch ( const CombinedCallWaits & )
+    {
+      waits = true ;
+    }
+    combining_monitor = previous ;
+    if ( waits )
+      deferred.discard_from( mark );
+    else
+      deferred.move_to( *call->deferred, mark );
+
+    finish_combined( *call, waits ? call_retry : call_done );
+  }
+}
+// -----------------------------------------------------------------------------
+// mark a call run by a combiner: a thread given back its call enters the
+// monitor as usual, and one whose call is done is removed from the monitor
+// queue, if it is waiting there, and waked up
+
+void MonitorBase::finish_combined( CombinedCall & call, unsigned status )
+{
+  Waiter * w ;
+
+  {
+    // acquire queues access mutex
+    std::unique_lock<std::mutex> lock( queues_mtx );
+
+    w = status == call_done ? call.waiter : nullptr ;
+    if ( w != nullptr )
+    {
+      const bool removed = monitor_queue.remove( w );
+      assert( removed );
+      (void) removed ;
+      if ( urgent_queue.get_nwt() == 0 && monitor_queue.get_nwt() == 0 )
+        state.fetch_and( ~queued, std::memory_order_relaxed );
+    }
+    call.status.store( status, std::memory_order_release );
+
+    // release queues access mutex (destroy 'lock'), 'call' may not exist any more
+  }
+
+  if ( w != nullptr )
+    w->unpark();
+}
+
+// *****************************************************************************
+//  MonitorBase: asynchronous calls
+
+void MonitorBase::submit_async( std::shared_ptr<AsyncCall> && call )
+{
+  MonitorExecutor * ex = executor.load( std::memory_order_acquire );
+  if ( ex == nullptr )
+  {
+    std::lock_guard<std::mutex> lock( queues_mtx );
+    ex = executor.load( std::memory_order_relaxed );
+    if ( ex == nullptr )
+    {
+      ex = new MonitorExecutor( *this ) ;
+      executor.store( ex, std::memory_order_release );
+    }
+  }
+  ex->submit( std::move( call ) );
+}
+
+// *****************************************************************************
+//  AsyncCall
+
+AsyncCall::AsyncCall( void (*p_invoke)( AsyncCall & ) )
+:  invoke( p_invoke ),
+   status( async_queued ),
+   waiter( nullptr )
+{
+}
+// -----------------------------------------------------------------------------
+
+bool AsyncCall::ready() const
+{
+  return status.load( std::memory_order_acquire ) == async_done ;
+}
+// -----------------------------------------------------------------------------
+// (parks just once: after the exchange in 'complete' exactly one unpark comes)
+
+void AsyncCall::wait()
+{
+  if ( ready() )
+    return ;
+
+  waiter = &ParkSlot::current() ;
+  unsigned expected = async_queued ;
+  if ( status.compare_exchange_strong( expected, async_waited, std::memory_order_acq_rel ) )
+    waiter->park();
+  assert( ready() );
+}
+// -----------------------------------------------------------------------------
+
+void AsyncCall::complete()
+{
+  if ( status.exchange( async_done, std::memory_order_acq_rel ) == async_waited )
+    waiter->unpark();
+}
+
+// *****************************************************************************
+//  MonitorExecutor
+
+MonitorExecutor::MonitorExecutor( MonitorBase & p_monitor )
+:  monitor( p_monitor ),
+   head( new Node ),
+   sleeping( false ),
+   stopping( false ),
+   detached( false ),
+   slot( nullptr )
+{
+   tail   = head.load() ;
+   thread = VirtualTime::spawn( &MonitorExecutor::run, this );
+}
+// -----------------------------------------------------------------------------
+
+MonitorExecutor::~MonitorExecutor()
+{
+   // (queued calls keep the monitor alive: only the stub is left)
+   assert( tail->next.load() == nullptr );
+   delete tail ;
+}
+// -----------------------------------------------------------------------------
+// a single exchange on 'head', plus an unpark only if the executor sleeps
+
+void MonitorExecutor::submit( std::shared_ptr<AsyncCall> && call )
+{
+   Node * n = new Node ;
+   n->call = std::move( call );
+
+   Node * prev = head.exchange( n, std::memory_order_acq_rel );
+   prev->next.store( n, std::memory_order_seq_cst );
+
+   // (the executor sets 'sleeping' and then checks the queue again)
+   if ( sleeping.load( std::memory_order_seq_cst ) && sleeping.exchange( false ) )
+      slot->unpark();
+}
+// -----------------------------------------------------------------------------
+// (called by the monitor destructor: no calls are queued)
+
+void MonitorExecutor::stop()
+{
+   const bool own_thread = ( thread.get_id() == std::this_thread::get_id() ),
+              simulated  = ( ParkSlot::current().actor != nullptr );
+
+   if ( own_thread || simulated )
+   {
+      detached = true ;
+      thread.detach();
+   }
+   stopping.store( true, std::memory_order_seq_cst );
+   if ( own_thread )
+      return ;
+   if ( sleeping.exchange( false ) )
+      slot->unpark();
+   if ( ! simulated )
+   {
+      thread.join();
+      delete this ;
+   }
+}
+// -----------------------------------------------------------------------------
+
+MonitorExecutor::Node * MonitorExecutor::pop()
+{
+   Node * next = tail->next.load( std::memory_order_seq_cst );
+   if ( next == nullptr )
+      return nullptr ;   // empty (or a producer is just linking its node)
+
+   delete tail ;
+   tail = next ;         // 'next' becomes the stub, its call is returned
+   return next ;
+}
+// -----------------------------------------------------------------------------
+// run each call in its own entry to the monitor (as a call proxy does)
+
+void MonitorExecutor::run()
+{
+   slot = &ParkSlot::current() ;
+   ThreadIdentity::current().set_name( monitor.name + " (executor)" );
+
+   for( ;; )
+   {
+      Node * n = pop();
+      if ( n != nullptr )
+      {
+         std::shared_ptr<AsyncCall> call = std::move( n->call );
+
+         DeferredActions & deferred = DeferredActions::current() ;
+         const unsigned    mark     = deferred.size() ;
+         monitor.enter();
+         call->invoke( *call );
+         monitor.leave();
+         if ( mark < deferred.size() )
+            deferred.run_from( mark );
+
+         call->complete();
+         call.reset();   // (it may destroy the monitor, and stop this executor)
+         if ( stopping.load( std::memory_order_seq_cst ) )
+            break ;
+         continue ;
+      }
+
+      // the queue looks empty: announce sleeping, then check again
+      sleeping.store( true, std::memory_order_seq_cst );
+      if ( tail->next.load( std::memory_order_seq_cst ) != nullptr || stopping.load( std::memory_order_seq_cst ) )
+      {
+         // take the flag back, or consume the unpark of whoever took it
+         if ( ! sleeping.exchange( false ) )
+            slot->park();
+         if ( stopping.load( std::memory_order_seq_cst ) )
+            break ;
+         continue ;
+      }
+      slot->park();
+      if ( stopping.load( std::memory_order_seq_cst ) )
+         break ;
+   }
+
+   if ( detached )
+      delete this ;
+}
+
+// *****************************************************************************
+//  MonitorBase: statistics
+
+void MonitorBase::set_stats_enabled( bool enabled )
+{
+  if ( enabled )
+    std::call_once( stats_calibrated, stats_calibrate );
+  stats_enabled.store( enabled, std::memory_order_relaxed );
+}
+// -----------------------------------------------------------------------------
+
+bool MonitorBase::get_stats_enabled() const
+{
+  return stats_enabled.load( std::memory_order_relaxed );
+}
+// -----------------------------------------------------------------------------
+// statistics block of the calling thread (looked up in the thread local
+// cache, or in the monitor blocks vector on a cache miss)
+
+StatsBlock & MonitorBase::stats_block()
+{
+  // most usual case: the same monitor as last time
+  if ( stats_cache[0].monitor_id == monitor_id )
+    return *stats_cache[0].block ;
+
+  unsigned     pos   = 1 ;
+  StatsBlock * block = nullptr ;
+
+  while ( pos < stats_cache_size && stats_cache[pos].monitor_id != monitor_id )
+    pos++ ;
+
+  if ( pos < stats_cache_size )
+    block = stats_cache[pos].block ;
+  else
+  {
+    // cache miss: the least recently used entry is replaced
+    pos = stats_cache_size-1 ;
+
+    std::unique_lock<std::mutex> lock( stats_mtx );
+    const ThreadIdentity * me = &ThreadIdentity::current() ;
+    for( auto & b : stats_blocks )
+      if ( &b->identity == me )
+      {
+        block = b.get() ;
+        break ;
+      }
+    if ( block == nullptr )
+    {
+      stats_blocks.emplace_back( new StatsBlock() );
+      block = stats_blocks.back().get() ;
+    }
+  }
+
+  // move the entry to the front of the cache
+  for( ; 0 < pos ; pos-- )
+    stats_cache[pos] = stats_cache[pos-1] ;
+  stats_cache[0].monitor_id = monitor_id ;
+  stats_cache[0].block      = block ;
+
+  return *block ;
+}
+// -----------------------------------------------------------------------------
+// counters of the calling thread for a condition variable (the thread block
+// only grows while holding the monitor 'stats_mtx', as snapshots read it)
+
+static CondVarCounters & cond_counters( StatsBlock & block, unsigned index,
+                                        std::mutex & stats_mtx )
+{
+  if ( block.conds.size() <= index )
+  {
+    std::unique_lock<std::mutex> lock( stats_mtx );
+    block.conds.resize( index+1 );
+  }
+  return block.conds[index] ;
+}
+// -----------------------------------------------------------------------------
+// the thread owns the monitor again after being blocked since 'block_start'
+// (in a condition or in the urgent queue): the hold time starts again, moved
+// forward by the blocked time, so it only counts the time in the monitor
+
+static void stats_resumed( StatsBlock & block, uint64_t block_start, uint64_t now )
+{
+  if ( block.scope_start != 0 )
+    block.scope_start += now - block_start ;
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::stats_entered( uint64_t wait_start )
+{
+  StatsBlock &   block = stats_block();
+  const uint64_t now   = stats_now();
+
+  block.entries.add( 1 );
+  if ( wait_start != 0 )
+    block.contended_entries.add( 1 );
+  block.entry_wait.record( wait_start == 0 ? 0 : uint64_t( double( now - wait_start )
+                              * stats_ns_per_tick.load( std::memory_order_relaxed ) ) );
+  block.scope_start = now ;
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::stats_leaving()
+{
+  StatsBlock & block = stats_block();
+
+  // nothing is known when the statistics were enabled inside the procedure
+  if ( block.scope_start == 0 )
+    return ;
+  block.hold.record( stats_since( block.scope_start ) );
+  block.scope_start = 0 ;
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::stats_waited( ThreadsQueue & queue, uint64_t wait_start, bool signalled )
+{
+  StatsBlock &      block = stats_block();
+  CondVarCounters & c     = cond_counters( block, queue.get_index(), stats_mtx );
+  const uint64_t    now   = stats_now();
+
+  c.wait.record( stats_ns( now - wait_start ) );
+  stats_resumed( block, wait_start, now );
+  if ( ! signalled )
+    c.timeouts.add( 1 );
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::stats_urgent( uint64_t urgent_start )
+{
+  StatsBlock &   block = stats_block();
+  const uint64_t now   = stats_now();
+
+  block.urgent.record( stats_ns( now - urgent_start ) );
+  stats_resumed( block, urgent_start, now );
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::stats_signalled( ThreadsQueue & queue, unsigned wakeups )
+{
+  CondVarCounters & c = cond_counters( stats_block(), queue.get_index(), stats_mtx );
+
+  c.signals.add( 1 );
+  c.wakeups.add( wakeups );
+}
+// -----------------------------------------------------------------------------
+// snapshot of the statistics of every thread
+
+std::vector<MonitorStats> MonitorBase::get_stats()
+{
+  std::vector<MonitorStats> result ;
+  std::unique_lock<std::mutex> lock( stats_mtx );
+
+  for( auto & bp : stats_blocks )
+  {
+    const StatsBlock & block = *bp ;
+    MonitorStats       ms ;
+
+    ms.monitor_name      = name ;
+    ms.thread_name       = block.identity.name() ;
+    ms.entries           = block.entries.get();
+    ms.contended_entries = block.contended_entries.get();
+    block.entry_wait.read( ms.entry_wait );
+    block.hold.read( ms.hold );
+    block.urgent.read( ms.urgent );
+
+    for( unsigned i = 0 ; i < block.conds.size() ; i++ )
+    {
+      const CondVarCounters & c = block.conds[i] ;
+      CondVarStats            cs ;
+
+      cs.index    = i ;
+      cs.signals  = c.signals.get();
+      cs.wakeups  = c.wakeups.get();
+      cs.timeouts = c.timeouts.get();
+      c.wait.read( cs.wait );
+      if ( cs.signals != 0 || cs.wait.count != 0 )
+        ms.conds.push_back( cs );
+    }
+    result.push_back( ms );
+  }
+  return result ;
+}
+// -----------------------------------------------------------------------------
+
+MonitorStats MonitorBase::get_total_stats()
+{
+  MonitorStats total ;
+  total.monitor_name = name ;
+  total.thread_name  = "(all)" ;
+
+  for( const MonitorStats & ms : get_stats() )
+    total.add( ms );
+  return total ;
+}
+// -----------------------------------------------------------------------------
+
+static void print_histogram( std::ostream & os, const std::string & label, const Histogram & h )
+{
+  os << "      " << std::left << std::setw( 11 ) << label << std::right
+     << ": " << std::setw( 9 ) << h.count << " times, mean "
+     << std::fixed << std::setprecision( 2 ) << h.mean_ns()/1000.0
+     << " us, p50 " << double( h.percentile_ns( 0.50 ) )/1000.0
+     << " us, p99 " << double( h.percentile_ns( 0.99 ) )/1000.0
+     << " us, max " << double( h.max_ns )/1000.0 << " us" << std::endl ;
+}
+// -----------------------------------------------------------------------------
+
+static void print_monitor_stats( std::ostream & os, const MonitorStats & ms )
+{
+  os << "   thread '" << ms.thread_name << "': " << ms.entries << " entries, "
+     << ms.contended_entries << " contended" << std::endl ;
+  print_histogram( os, "entry wait", ms.entry_wait );
+  print_histogram( os, "hold", ms.hold );
+  if ( 0 < ms.urgent.count )
+    print_histogram( os, "urgent", ms.urgent );
+  for( const CondVarStats & cs : ms.conds )
+  {
+    os << "      cond " << cs.index << "     : " << cs.signals << " signals, "
+       << cs.wakeups << " wakeups, " << cs.timeouts << " timeouts" << std::endl ;
+    if ( 0 < cs.wait.count )
+      print_histogram( os, "  wait", cs.wait );
+  }
+}
+// -----------------------------------------------------------------------------
+
+void MonitorBase::print_stats( std::ostream & os )
+{
+  const std::vector<MonitorStats> all = get_stats();
+  MonitorStats total ;
+  total.thread_name = "(all)" ;
+  for( const MonitorStats & ms : all )
+    total.add( ms );
+
+  // (the caller's stream format is restored at the end)
+  const std::ios::fmtflags flags     = os.flags();
+  const std::streamsize    precision = os.precision();
+
+  os << "monitor '" << name << "' statistics:" << std::endl ;
+  print_monitor_stats( os, total );
+  for( const MonitorStats & ms : all )
+    print_monitor_stats( os, ms );
+
+  os.flags( flags );
+  os.precision( precision );
+}
 
 // *****************************************************************************
 
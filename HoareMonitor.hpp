@@ -1,7 +1,7 @@
 
 // *****************************************************************************
 //
-// C++ Hoare Monitors. Classes declarations.
+// C++ Hoare Monitors (and Mesa monitors). Classes declarations.
 // Carlos Ureña, Noviembre 2016
 //
 // This is a translation to modern C++ (C++11) of the Java code described here:
@@ -20,89 +20,579 @@
 
 #include <iostream>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <cassert>
 #include <vector>
-#include <map>
+#include <deque>
 #include <thread>  // thread
-#include <memory> // shared_ptr, make_shared
+#include <chrono>  // steady_clock
+#include <memory> // shared_ptr, make_shared, unique_ptr
+#include <cstdint> // uint64_t
+#include <cstddef> // max_align_t
+#include <new>     // placement new
+#include <type_traits>
+#include <utility> // forward
+#include <functional> // function, bind
+#include <cstdlib>    // posix_memalign, free
 
-// uncomment to get a log
+// uncomment to get a trace of the monitor events (see "Monitor events trace" below)
 //#define TRAZA_M
 
+// uncomment to pack the monitor fields, without separating them in cache lines
+// (see MonitorBase), to measure the cost of false sharing
+//#define COMPACTO_M
+
 namespace HM
 {
 
 using namespace std ;
-class HoareMonitor ;
-class ThreadsQueue ;
+class MonitorBase ;
+class Waiter ;
+class StatsBlock ;
+struct CombineSlots ;
+class ParkSlot ;
+class MonitorExecutor ;
 template<class T> class Call_proxy ;
+template<class Policy> class BasicMonitor ;
+template<unsigned N, class Policy> class BasicFixedMonitor ;
+
+// size of a cache line, used to align data shared among threads
+static const std::size_t cache_line_size = 64 ;
+
+// start of a group of fields written by other threads than the previous ones
+#ifdef COMPACTO_M
+#define HM_LINE_ALIGNED
+#else
+#define HM_LINE_ALIGNED alignas( cache_line_size )
+#endif
+
+// *****************************************************************************
+//
+// Class ThreadsQueue
+//
+// A FIFO queue of waiters (threads blocked in the monitor), as an intrusive
+// singly linked list (no memory is allocated for waiting).
+// All operations must be done while holding the monitor 'queues_mtx'.
+// Operations:
+//      push   : add a waiter at the end of the queue
+//      pop    : extract the first waiter in the queue (nullptr if none)
+//      remove : extract a given waiter (false if it was not in the queue)
+//
+// The index identifies the condition variable owning the queue inside its
+// monitor (used for statistics).
+//
+// *****************************************************************************
+
+class ThreadsQueue
+{
+   private:
+
+   Waiter *  head ;   // first waiter (the next one to be waked up)
+   Waiter *  tail ;   // last waiter
+   unsigned  num_wt ; // current number of waiting threads
+   unsigned  index ;  // condition variable index in the monitor
+
+   public:
+
+   ThreadsQueue() : head( nullptr ), tail( nullptr ), num_wt( 0 ), index( 0 ) {}
+
+   void     push( Waiter * w );
+   Waiter * pop();
+   bool     remove( Waiter * w );
+   unsigned get_nwt() const { return num_wt ; }
+
+   void     set_index( unsigned i ) { index = i ; }
+   unsigned get_index() const { return index ; }
+
+} ;
+
+// *****************************************************************************
+//
+// Monitor statistics
+//
+// Snapshot of the statistics gathered by a monitor (see
+// MonitorBase::get_stats). Times are in nanoseconds, and they are kept in
+// histograms with power of two buckets: bucket 0 holds zero durations, and
+// bucket b > 0 holds durations in [2^(b-1), 2^b).
+//
+//   Histogram    : count, sum, maximum and buckets of a set of durations
+//   CondVarStats : signals and waits on a condition variable
+//   MonitorStats : statistics of a thread in a monitor (or of all threads)
+//
+// *****************************************************************************
+
+struct Histogram
+{
+   static const unsigned num_buckets = 40 ;
+
+   uint64_t count ;                  // number of durations
+   uint64_t sum_ns ;                 // sum of all the durations
+   uint64_t max_ns ;                 // longest duration
+   uint64_t buckets[num_buckets] ;   // number of durations in each bucket
+
+   Histogram() ;
+
+   static unsigned bucket( uint64_t ns );    // bucket of a duration
+   void     record( uint64_t ns );           // add a duration
+   void     add( const Histogram & other );  // accumulate other histogram
+   double   mean_ns() const ;
+   uint64_t percentile_ns( double q ) const ; // upper bound of the bucket
+} ;
+
+struct CondVarStats
+{
+   unsigned  index ;    // condition variable index in the monitor
+   uint64_t  signals ;  // signal operations done (including signal_all)
+   uint64_t  wakeups ;  // threads signalled by them
+   uint64_t  timeouts ; // timed waits which expired
+   Histogram wait ;     // time from wait to re-entering the monitor
+
+   CondVarStats() : index( 0 ), signals( 0 ), wakeups( 0 ), timeouts( 0 ) {}
+} ;
+
+struct MonitorStats
+{
+   std::string monitor_name ;
+   std::string thread_name ;         // "(all)" for the totals
+
+   uint64_t  entries ;               // monitor procedures called
+   uint64_t  contended_entries ;     // ... which found the monitor busy
+   Histogram entry_wait ;            // time to enter (0 if uncontended)
+   Histogram hold ;                  // from entering to leaving (call proxy scope)
+   Histogram urgent ;                // time in the urgent queue after signal
+   std::vector<CondVarStats> conds ; // one per condition variable used
+
+   MonitorStats() : entries( 0 ), contended_entries( 0 ) {}
+
+   void add( const MonitorStats & other );  // accumulate other thread stats
+} ;
+
+// *****************************************************************************
+//
+// Signal policies
+//
+// Each policy defines the semantics of the signal operations on condition
+// variables, and it is selected at compile time (as a template parameter of
+// BasicMonitor and BasicCondVar), so a monitor only pays for its own policy.
+//
+//   SignalUrgentWait : classic Hoare semantics, the signalled thread runs at
+//                      once and the signaller waits in the urgent queue
+//   SignalContinue   : Mesa semantics ("signal and continue"), the signalled
+//                      thread waits in the monitor queue and the signaller
+//                      keeps running (waiting threads must re-check their
+//                      condition in a loop)
+//
+// *****************************************************************************
+
+struct SignalUrgentWait
+{
+   static void signal          ( MonitorBase & m, ThreadsQueue & queue );
+   static void signal_all      ( MonitorBase & m, ThreadsQueue & queue );
+   static void signal_and_leave( MonitorBase & m, ThreadsQueue & queue );
+} ;
+
+struct SignalContinue
+{
+   static void signal          ( MonitorBase & m, ThreadsQueue & queue );
+   static void signal_all      ( MonitorBase & m, ThreadsQueue & queue );
+   static void signal_and_leave( MonitorBase & m, ThreadsQueue & queue );
+} ;
 
 // *****************************************************************************
 //
-// Class: CondVar
+// Class: BasicCondVar
 //
-// a class for conditions variables with "urgent wait" semantics on signal
-// used in Hoare Monitors
-// only to be used from  HoareMonitor class
+// a class for conditions variables, with the signal semantics given by
+// the policy (see above).
+// only to be used from a BasicMonitor or BasicFixedMonitor class (with the same policy)
 //
 // *****************************************************************************
 
-class CondVar
+template<class Policy> class BasicCondVar
 {
    public:
 
-   void     wait();     // unconditionally wait on the underlying thread queue
-   void     signal();   // signal operation, with "urgent wait" semantics
-   unsigned get_nwt() ; // returns number of threads waiting in the cond.var.
+   void     wait();       // unconditionally wait on the underlying thread queue
+
+   // wait until signalled or until a deadline (or timeout) has passed.
+   // returns true if signalled (with the usual policy semantics), or false
+   // on timeout: then the thread leaves the condition queue and re-enters the
+   // monitor (through the monitor queue) before returning.
+   // deadlines are measured with VirtualTime::now() (the steady clock unless
+   // a simulation is running)
+   bool     wait_until( const std::chrono::steady_clock::time_point & deadline );
+   template<class Rep, class Period>
+   bool     wait_for( const std::chrono::duration<Rep,Period> & timeout );
+   void     signal();     // signal operation, with the policy semantics
+   void     signal_all(); // signal all threads waiting (when called)
+
+   // signal and leave the monitor at once: must be the last operation of the
+   // monitor procedure (the calling thread does not own the monitor any more,
+   // and the call proxy does not leave it again). With Hoare semantics the
+   // monitor is handed over to the signalled thread, and the signaller never
+   // waits in the urgent queue.
+   void     signal_and_leave();
+   unsigned get_nwt() ;   // returns number of threads waiting in the cond.var.
 
    bool empty() { return get_nwt() == 0 ; }
 
    // create an un-initialized condition variable, not usable
-   CondVar();
+   BasicCondVar() : monitor( nullptr ), queue( nullptr ) {}
 
    // --------------------------------------------------------------------------
    private:
 
-   friend class HoareMonitor ; // forward declaration of friend monitor class
-   HoareMonitor * monitor ;    // reference to the monitor for this variable
-   unsigned       index ;      // index of the corresponding threads queue in
-                               // the monitor threads queues vector
+   // the monitors create cond. vars.
+   friend class BasicMonitor<Policy> ;
+   template<unsigned N, class P> friend class BasicFixedMonitor ;
+
+   MonitorBase *  monitor ;    // reference to the monitor for this variable
+   ThreadsQueue * queue ;      // corresponding threads queue, owned by the monitor
 
    // private constructor, only to be used from inside monitor implementation
-   CondVar( HoareMonitor * p_monitor, unsigned p_index ) ;
+   BasicCondVar( MonitorBase * p_monitor, ThreadsQueue * p_queue )
+   :  monitor( p_monitor ), queue( p_queue ) {}
 };
 
 // *****************************************************************************
 //
-// Class: HoareMonitor
+// Class: ThreadIdentity
+//
+// Identity of a thread, shared by all the monitors: a compact integer
+// identifier (0,1,2,..., in order of first use) and the registered name.
+// The identity of the calling thread is reached through a thread local
+// pointer, so looking it up needs no locks (nor allocations). The name is
+// set once and never changes, so other threads (statistics snapshots) can
+// read it at any time; identities are never freed, for the same reason.
+//
+// *****************************************************************************
+
+class ThreadIdentity
+{
+   public:
+
+   // identity of the calling thread (created on first use)
+   static ThreadIdentity & current() ;
+
+   unsigned id() const { return ident ; }
+
+   // registered name, or "(unknown)" if not registered
+   const std::string & name() const ;
+
+   // register the name, returns false if a different one was already registered
+   bool set_name( const std::string & new_name );
+
+   // --------------------------------------------------------------------------
+   private:
+
+   const unsigned                     ident ;
+   std::atomic<const std::string *>   name_ptr ;  // nullptr until registered
+
+   explicit ThreadIdentity( unsigned p_ident ) : ident( p_ident ), name_ptr( nullptr ) {}
+   static ThreadIdentity * create() ;
+} ;
+
+// *****************************************************************************
+//
+// Class: DeferredActions
+//
+// Actions registered by monitor procedures (see MonitorBase::defer) to be
+// run when the procedure ends, just after the call proxy has left the monitor:
+// work which does not need mutual exclusion (output, metrics, notifications
+// to other subsystems) is done outside of the critical section.
+//
+// Each thread owns a buffer with a fixed number of slots, and each slot holds
+// a callable object of a limited size (no memory is allocated). The buffer is
+// used as a stack: a call proxy remembers its size on entry, and it runs (in
+// registration order) the actions added after that, so procedures of other
+// monitors called from a procedure run their own actions.
+// When the buffer is full, an action is run at once (inside the monitor).
+// Actions must not throw exceptions (they are run by a destructor).
+//
+// *****************************************************************************
+
+class DeferredActions
+{
+   public:
+
+   static const unsigned    max_actions     = 16 ;
+   static const std::size_t max_action_size = 48 ;  // bytes of captured data
+
+   // buffer of the calling thread
+   static DeferredActions & current() ;
+
+   template<class F> void add( F && action );
+
+   // number of actions registered (and not yet run)
+   unsigned size() const { return count ; }
+
+   // run the actions registered after 'mark' (the size at some time), and
+   // remove them
+   void run_from( unsigned mark );
+
+   // move the actions registered after 'mark' to the end of 'other' (the
+   // buffer of another thread, which must not be using it meanwhile)
+   void move_to( DeferredActions & other, unsigned mark );
+
+   // remove the actions registered after 'mark', without running them
+   void discard_from( unsigned mark );
+
+   // --------------------------------------------------------------------------
+   private:
+
+   struct Slot
+   {
+      alignas( std::max_align_t ) unsigned char storage[max_action_size] ;
+      void (*invoke)  ( void * ) ;
+      void (*destroy) ( void * ) ;
+      void (*relocate)( void * from, void * to ) ;  // move-construct, destroy the source
+   } ;
+
+   Slot     slots[max_actions] ;
+   unsigned count ;   // (zero-initialized: only thread local objects are used)
+} ;
+
+// *****************************************************************************
+//
+// Class: VirtualTime
+//
+// Virtual clock for simulations. Once 'start' is called, the threads taking
+// part in the simulation (the starting one and those created with 'spawn')
+// run one at a time: a thread runs until it blocks (in a monitor queue, in a
+// timed wait or in 'sleep_for'), and then the next ready thread, in FIFO
+// order, takes its turn. When no thread is ready, the clock jumps forward to
+// the earliest pending deadline, so sleeps and timeouts take no real time,
+// and the execution only depends on the program (and its random seeds).
+//
+// When the virtual time is not started, 'now' is the steady clock, the sleep
+// functions are the usual ones and 'spawn' just creates a thread.
+// Operations:
+//      start  : the calling thread starts the simulation (before creating any thread)
+//      spawn  : create a thread which takes part in the simulation
+//      leave  : the calling thread stops taking part (e.g. before joining the others)
+//      now    : current (virtual) time, for deadlines and time measurements
+//      sleep_for, sleep_until : block the calling thread during virtual time
+//
+// *****************************************************************************
+
+class VirtualTime
+{
+   public:
+
+   static void start();
+   static bool active() { return started.load( std::memory_order_relaxed ); }
+   static void leave();
+
+   static std::chrono::steady_clock::time_point now();
+
+   template<class Rep, class Period>
+   static void sleep_for( const std::chrono::duration<Rep,Period> & duration );
+   static void sleep_until( const std::chrono::steady_clock::time_point & time );
+
+   template<class F, class... Args>
+   static std::thread spawn( F && function, Args &&... args );
+
+   // --------------------------------------------------------------------------
+   private:
+
+   static std::atomic<bool>                      started ;
+   static std::chrono::steady_clock::time_point  origin ;   // time when started
+   static std::atomic<long long>                 elapsed ;  // virtual nanoseconds since 'origin'
+
+   static std::thread spawn_body( std::function<void()> && body );
+
+   friend struct VirtualScheduler ;   // (HoareMonitor.cpp)
+} ;
+
+// *****************************************************************************
+//
+// Combined calls (flat combining, see MRef::combine)
+//
+// A thread calling a procedure through 'combine' publishes the call in its
+// slot of the monitor publication list (indexed by its ThreadIdentity), and
+// the thread which gets the monitor runs every published call before leaving
+// it: a burst of short calls from many threads costs a single enter/leave
+// pair, and the monitor state stays in the cache of a single processor.
+//
+// *****************************************************************************
+
+struct CombinedCall
+{
+   void (*invoke)( void * ) ;      // runs the call (stores its result)
+   void *                callable ;
+   std::atomic<unsigned> status ;  // pending, done or retry (see MonitorBase::call_combined)
+   DeferredActions *     deferred ;  // actions of the caller (a combiner moves there those of the call)
+   Waiter *              waiter ;    // the caller, while in the monitor queue (protected by queues_mtx)
+} ;
+
+// result of a combined call (the type must be default-constructible)
+template<class R> struct CombinedResult
+{
+   R value ;
+   template<class F, class M> void run( F & f, M & m ) { value = f( m ); }
+   R get() { return std::move( value ); }
+} ;
+
+template<> struct CombinedResult<void>
+{
+   template<class F, class M> void run( F & f, M & m ) { f( m ); }
+   void get() {}
+} ;
+
+// *****************************************************************************
+//
+// Class: AsyncCall
+//
+// A call queued by MRef::async for the executor of a monitor: a thread, one
+// per monitor (created on the first asynchronous call), which runs the queued
+// calls one after the other, in order, each one in its own entry to the
+// monitor. The call is shared by the queue and the caller's MonitorFuture.
+// Operations:
+//      ready : the call has run
+//      wait  : block until the call has run (a single thread may wait)
+//
+// *****************************************************************************
+
+class AsyncCall
+{
+   public:
+
+   bool ready() const ;
+   void wait() ;
+
+   // --------------------------------------------------------------------------
+   protected:
+
+   explicit AsyncCall( void (*p_invoke)( AsyncCall & ) );
+
+   // --------------------------------------------------------------------------
+   private:
+
+   friend class MonitorExecutor ;   // (HoareMonitor.cpp)
+
+   void (*invoke)( AsyncCall & ) ;   // runs the call (the executor owns the monitor)
+   std::atomic<unsigned> status ;    // queued, waited (a thread is in 'wait') or done
+   ParkSlot *            waiter ;    // slot of the thread in 'wait'
+
+   // mark the call as done and wake up the waiting thread, if any
+   void complete();
+} ;
+
+// the result of an asynchronous call
+template<class R> class AsyncCallResult : public AsyncCall
+{
+   public:
+   CombinedResult<R> result ;
+
+   protected:
+   explicit AsyncCallResult( void (*p_invoke)( AsyncCall & ) ) : AsyncCall( p_invoke ) {}
+} ;
+
+// an asynchronous call of 'f( monitor )' (it keeps the monitor alive)
+template<class R, class MonClass, class F> class AsyncCallOf : public AsyncCallResult<R>
+{
+   public:
+   AsyncCallOf( const std::shared_ptr<MonClass> & p_monitor, F && p_f )
+   :  AsyncCallResult<R>( &run ),
+      monitor( p_monitor ),
+      f( std::forward<F>( p_f ) )
+   {
+   }
+
+   private:
+   std::shared_ptr<MonClass>          monitor ;
+   typename std::decay<F>::type       f ;
+
+   static void run( AsyncCall & call )
+   {
+      AsyncCallOf & self = static_cast<AsyncCallOf &>( call ) ;
+      self.result.run( self.f, *self.monitor );
+   }
+} ;
+
+// *****************************************************************************
+//
+// Class: MonitorFuture
 //
-// Base class for classic Hoare-style monitors
-// (with "urgent wait" signal semantics)
+// Handle of an asynchronous call (see MRef::async), to wait for it and get
+// its result ('get' can be called only once). Discarding it is fine: the
+// call runs anyway.
 //
 // *****************************************************************************
 
-class HoareMonitor
+template<class R> class MonitorFuture
 {
    public:
 
-   // register calling thread name in the monitor
+   bool ready() const { return call->ready(); }
+   void wait()        { call->wait(); }
+   R    get()         { call->wait(); return call->result.get(); }
+
+   // --------------------------------------------------------------------------
+   private:
+
+   template<class MonClass> friend class MRef ;
+
+   std::shared_ptr< AsyncCallResult<R> > call ;
+
+   explicit MonitorFuture( std::shared_ptr< AsyncCallResult<R> > p_call ) : call( std::move( p_call ) ) {}
+} ;
+
+// *****************************************************************************
+//
+// Class: MonitorBase
+//
+// Implementation of monitors, common to all signal policies: mutual
+// exclusion, condition variables queues and waiting.
+// Concrete monitors derive from BasicMonitor (see below), not from this class.
+//
+// *****************************************************************************
+
+class MonitorBase
+{
+   public:
+
+   // register calling thread name (shared by all the monitors, see ThreadIdentity)
    void register_thread_name( const std::string & name );
    void register_thread_name( const std::string & rol, const int num );
 
-   // get this thread registered name (or "unknown" if not registered)
-   std::string get_thread_name()  ;
+   // get this thread registered name (or "(unknown)" if not registered)
+   const std::string & get_thread_name()  ;
+
+   // set the maximum number of iterations a thread entering the monitor spins
+   // (waiting for the monitor to become free) before blocking, 0 disables
+   // spinning. The actual number of iterations adapts to the observed hold
+   // times, up to this limit.
+   void     set_spin_limit( unsigned max_spins );
+   unsigned get_spin_limit() const ;
+
+   // enable or disable statistics gathering (disabled by default). The
+   // statistics are accumulated per thread, without shared locks or counters,
+   // and they are kept when disabled.
+   void set_stats_enabled( bool enabled );
+   bool get_stats_enabled() const ;
+
+   // snapshot of the statistics, one element per thread which used the monitor
+   // (named after the registered thread names), or the totals of all threads
+   std::vector<MonitorStats> get_stats() ;
+   MonitorStats              get_total_stats() ;
+
+   // write the statistics (totals and per thread) in a readable form
+   void print_stats( std::ostream & os ) ;
 
    // --------------------------------------------------------------------------
    protected:  // methods to be called from derived classes (concrete monitors)
 
    // constructors and destructor
-   HoareMonitor() ;
-   HoareMonitor( const std::string & p_name ) ;
-   ~HoareMonitor();
+   MonitorBase() ;
+   MonitorBase( const std::string & p_name ) ;
+   ~MonitorBase();
 
-   // create a new condition variable in this monitor
-   CondVar newCondVar() ;
+   // register an action to be run when the running procedure ends, after
+   // leaving the monitor (see DeferredActions). The action must not use the
+   // monitor state: it is not protected any more when the action runs.
+   template<class F> void defer( F && action );
 
    // --------------------------------------------------------------------------
    private:
@@ -114,53 +604,676 @@ class HoareMonitor
    // allow friend classes to access private parts of this class
    template<typename MonClass> friend class Call_proxy ;
    template<typename MonClass> friend class MRef ;
-   friend class CondVar ;
+   template<typename Policy>   friend class BasicCondVar ;
+   friend struct SignalUrgentWait ;
+   friend struct SignalContinue ;
+   friend class MonitorExecutor ;
+
+   // The fields are grouped by the threads writing them, each group in its
+   // own cache lines (unless COMPACTO_M is defined): threads spinning on the
+   // state word or queued on 'queues_mtx' must not steal the lines written by
+   // the thread running in the monitor, nor the lines of the user state of
+   // the derived classes, which start in a new line (see 'line_end').
+
+   // ---- read-mostly: set at creation, or seldom changed
 
    // name of this monitor (useful for debugging)
    std::string name ;
 
-   // lock used for entering and exiting monitor queues,
-   // guarantees a single total order for all operations (any thread on any queue)
-   std::mutex queues_mtx ;
+   // unique monitor identifier (the key of the per thread statistics cache,
+   // and the monitor identifier in trace records)
+   uint64_t monitor_id ;
 
-   // true iif any thread is running in the monitor
-   bool running ;
+   // maximum number of spin iterations in 'enter'
+   std::atomic<unsigned> spin_limit ;
+
+   // statistics are gathered only when enabled
+   std::atomic<bool> stats_enabled ;
+
+   // publication list of combined calls (created on the first one)
+   std::atomic<CombineSlots *> combine_slots ;
+
+   // executor of asynchronous calls (created on the first one)
+   std::atomic<MonitorExecutor *> executor ;
+
+   // statistics blocks, one per thread which used the monitor
+   // (each block is only written by its thread, the vector grows under 'stats_mtx')
+   std::vector< std::unique_ptr<StatsBlock> > stats_blocks ;
+
+   // mutex used to access the statistics blocks vector and the blocks growth
+   std::mutex stats_mtx ;
+
+   // ---- control state: written on every entry and exit
+
+   // monitor state word, a combination of these bits:
+   //   running : some thread is running in the monitor
+   //   queued  : the monitor or the urgent queue is not empty
+   // an uncontended enter/leave pair is a single CAS on each side,
+   // 'queued' forces 'leave' to take 'queues_mtx' to hand the monitor over
+   // ('queued' is only modified while holding 'queues_mtx')
+   HM_LINE_ALIGNED std::atomic<unsigned> state ;
+   static const unsigned running = 1u, queued = 2u ;
+
+   // current (adaptive) number of spin iterations in 'enter'
+   std::atomic<unsigned> spin_budget ;
 
    // identifier for thread currently in the monitor (when running==true)
    std::thread::id running_thread_id ;
 
+   // ---- lock used for entering and exiting monitor queues,
+   // guarantees a single total order for all operations (any thread on any queue)
+   HM_LINE_ALIGNED std::mutex queues_mtx ;
+
+   // ---- queues, written while holding 'queues_mtx'
+
    // queue for threads waiting to enter the monitor
-   ThreadsQueue * monitor_queue ;
+   HM_LINE_ALIGNED ThreadsQueue monitor_queue ;
 
    // queue for threads waiting to re-enter the monitor after signal
-   ThreadsQueue * urgent_queue ;
+   ThreadsQueue urgent_queue ;
 
-   // vector with all queues for user defined condition variables
-   std::vector<ThreadsQueue *> queues ;
+   // (the queues for user defined condition variables are owned by the
+   // derived classes: BasicMonitor or BasicFixedMonitor)
 
-   // names map, updated in registerThreadName
-   std::map< std::thread::id, std::string > names_map ;
-
-   // mutex used to access the names map
-   std::mutex names_mtx ;
+#ifndef COMPACTO_M
+   // the tail padding of a base class may hold members of the derived
+   // classes, so the last line is filled explicitly
+   char line_end[ cache_line_size - 2*sizeof(ThreadsQueue) ] ;
+#endif
 
    // enter and leave the monitor
    void enter();
    void leave();
 
+   // enter the monitor after the fast path failed (spin or queue up)
+   void enter_contended();
+
+   // run a call in the monitor, maybe by the thread running in it (the
+   // calling thread waits until the call is done), see MRef::combine
+   void call_combined( CombinedCall & call );
+
+   // enter to run a published call, unless it is done meanwhile (returns false)
+   bool enter_combined( CombinedCall & call, Waiter & me );
+
+   // mark a call run by this thread as done or given back, and wake up its thread
+   void finish_combined( CombinedCall & call, unsigned status );
+
+   // run the calls published by other threads (the caller owns the monitor)
+   void run_published_calls( CombineSlots & slots );
+
+   // publication list of this monitor (created on first use)
+   CombineSlots & get_combine_slots();
+
+   // queue an asynchronous call for the executor (created on first use)
+   void submit_async( std::shared_ptr<AsyncCall> && call );
+
+   // statistics block of the calling thread in this monitor (created on first use)
+   StatsBlock & stats_block();
+
+   // record statistics when the calling thread enters (wait started at
+   // 'wait_start', 0 if uncontended) and when it leaves the monitor
+   void stats_entered( uint64_t wait_start );
+   void stats_leaving();
+
+   // record statistics of a wait on a queue (started at 'wait_start'), of a
+   // wait in the urgent queue, and of a signal on a queue (which signalled
+   // 'wakeups' threads); the blocked time is not part of the hold time
+   void stats_waited( ThreadsQueue & queue, uint64_t wait_start, bool signalled );
+   void stats_urgent( uint64_t urgent_start );
+   void stats_signalled( ThreadsQueue & queue, unsigned wakeups );
+
+   // enter the monitor only if it is free and nobody is queued (never blocks)
+   bool try_enter();
+
+   // take the monitor if free, or put the waiter in the monitor queue
+   bool acquire_or_queue( Waiter & me );
+
+   // true iif any thread is running in the monitor
+   bool is_running() const ;
+
+   // spin while the monitor is running, returns true if it was entered
+   bool spin_until_free();
+
    // initialize the monitor just after creation
    void initialize();
 
    // wait, signal and query on user-defined condition variables
-   // (q_index is the index of the corresponding queue in the queues table)
-   void     wait   ( unsigned q_index );
-   void     signal ( unsigned q_index );
-   unsigned get_nwt( unsigned q_index );
+   // (queue is the threads queue of the condition variable)
+   void     wait   ( ThreadsQueue & queue );
+   bool     wait_until( ThreadsQueue & queue,
+                        const std::chrono::steady_clock::time_point & deadline );
+   unsigned get_nwt( ThreadsQueue & queue );
+
+   // signal with "urgent wait" semantics: the signalled thread runs at once
+   void     signal_urgent( ThreadsQueue & queue );
+
+   // signal with "signal and continue" semantics: the signalled threads are
+   // moved to the monitor queue, the signalling thread keeps running
+   void     signal_continue( ThreadsQueue & queue, bool all );
+
+   // signal with "urgent wait" semantics and leave the monitor (the
+   // signalled thread gets the monitor, the signaller does not wait)
+   void     signal_urgent_and_leave( ThreadsQueue & queue );
+
+   // leave the monitor before the end of the procedure, the next 'leave'
+   // call from the same thread on this monitor (by the proxy) does nothing
+   void     leave_early();
 
    // allow a waiting thread to enter the monitor
-   void allow_another_to_enter() ;
+   // (returns the thread which got the monitor, to be waked up, if any)
+   Waiter * allow_another_to_enter() ;
+
+   // hand the monitor over to a waiting thread (without waking it up)
+   Waiter * hand_over( Waiter * w ) ;
 } ;
 
+// *****************************************************************************
+//
+// Class: BasicMonitor
+//
+// Base class for monitors, with the signal semantics given by the policy.
+// Concrete monitors derive from one of:
+//
+//   HoareMonitor : classic Hoare-style monitors ("urgent wait" semantics)
+//   MesaMonitor  : Mesa-style monitors ("signal and continue" semantics)
+//
+// in both cases 'CondVar' names the condition variables type of the monitor.
+// Any number of condition variables can be created (see BasicFixedMonitor
+// below for monitors with a number of conditions known at compile time)
+//
+// *****************************************************************************
+
+template<class Policy> class BasicMonitor : public MonitorBase
+{
+   public:
+
+   // condition variables type for this monitor
+   typedef BasicCondVar<Policy> CondVar ;
+
+   // --------------------------------------------------------------------------
+   protected:  // methods to be called from derived classes (concrete monitors)
+
+   // constructors and destructor
+   BasicMonitor() {}
+   BasicMonitor( const std::string & p_name ) : MonitorBase( p_name ) {}
+   ~BasicMonitor() ;
+
+   // create a new condition variable in this monitor
+   CondVar newCondVar() ;
+
+   // --------------------------------------------------------------------------
+   private:
+
+   // queues for user defined condition variables
+   // (a deque never moves its elements when growing at the end)
+   std::deque<ThreadsQueue> cond_queues ;
+} ;
+
+typedef BasicMonitor<SignalUrgentWait> HoareMonitor ;
+typedef BasicMonitor<SignalContinue>   MesaMonitor ;
+
+// *****************************************************************************
+//
+// Class: BasicFixedMonitor
+//
+// Base class for monitors with at most N condition variables, known at
+// compile time. The threads queues are stored inline, in a cache line aligned
+// array (no allocations, and no indirections on wait or signal).
+//
+//   FixedHoareMonitor<N> : Hoare-style monitors ("urgent wait" semantics)
+//   FixedMesaMonitor<N>  : Mesa-style monitors ("signal and continue" semantics)
+//
+// condition variables are obtained with:
+//   condVar<I>()  : variable number I (checked at compile time: I < N)
+//   condVar(i)    : variable number i (checked at run time)
+//   newCondVar()  : the next unused variable (checked at run time)
+//
+// *****************************************************************************
+
+template<unsigned N, class Policy> class BasicFixedMonitor : public MonitorBase
+{
+   static_assert( 0 < N, "a fixed monitor needs at least one condition variable" );
+
+   public:
+
+   // condition variables type for this monitor
+   typedef BasicCondVar<Policy> CondVar ;
+
+   // number of condition variables in this monitor
+   static const unsigned num_conds = N ;
+
+   // --------------------------------------------------------------------------
+   protected:  // methods to be called from derived classes (concrete monitors)
+
+   // constructors and destructor
+   BasicFixedMonitor() ;
+   BasicFixedMonitor( const std::string & p_name ) ;
+   ~BasicFixedMonitor() ;
+
+   // obtain the condition variable with a given index
+   template<unsigned I> CondVar condVar() ;
+   CondVar condVar( unsigned i ) ;
+
+   // obtain the next unused condition variable
+   CondVar newCondVar() ;
+
+   // --------------------------------------------------------------------------
+   private:
+
+   // queues for user defined condition variables
+   HM_LINE_ALIGNED ThreadsQueue cond_queues[N] ;
+
+   // index of the next unused condition variable (for 'newCondVar')
+   unsigned next_cond ;
+
+#ifndef COMPACTO_M
+   // the user state of the derived class starts in a new line (see MonitorBase)
+   char line_end[ cache_line_size - ( N*sizeof(ThreadsQueue) + sizeof(unsigned) ) % cache_line_size ] ;
+#endif
+} ;
+
+template<unsigned N> using FixedHoareMonitor = BasicFixedMonitor<N,SignalUrgentWait> ;
+template<unsigned N> using FixedMesaMonitor  = BasicFixedMonitor<N,SignalContinue> ;
+
+// condition variables of Hoare monitors
+typedef BasicCondVar<SignalUrgentWait> CondVar ;
+
+// *****************************************************************************
+//
+// BasicCondVar: implementation
+//
+// *****************************************************************************
+
+// unconditionally wait on the underlying thread queue
+
+template<class Policy> inline void BasicCondVar<Policy>::wait()
+{
+   assert( monitor != nullptr );
+   monitor->wait( *queue ) ;
+}
+// -----------------------------------------------------------------------------
+// wait until signalled (returns true) or until a deadline (returns false)
+
+template<class Policy> inline
+bool BasicCondVar<Policy>::wait_until( const std::chrono::steady_clock::time_point & deadline )
+{
+   assert( monitor != nullptr );
+   return monitor->wait_until( *queue, deadline ) ;
+}
+// -----------------------------------------------------------------------------
+
+template<class Policy> template<class Rep, class Period> inline
+bool BasicCondVar<Policy>::wait_for( const std::chrono::duration<Rep,Period> & timeout )
+{
+   return wait_until( VirtualTime::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>( timeout ) );
+}
+// -----------------------------------------------------------------------------
+// signal operation, with the policy semantics
+
+template<class Policy> inline void BasicCondVar<Policy>::signal()
+{
+   assert( monitor != nullptr );
+   Policy::signal( *monitor, *queue );
+}
+// -----------------------------------------------------------------------------
+// signal all the threads waiting when this is called
+
+template<class Policy> inline void BasicCondVar<Policy>::signal_all()
+{
+   assert( monitor != nullptr );
+   Policy::signal_all( *monitor, *queue );
+}
+// -----------------------------------------------------------------------------
+// signal and leave the monitor (last operation of a monitor procedure)
+
+template<class Policy> inline void BasicCondVar<Policy>::signal_and_leave()
+{
+   assert( monitor != nullptr );
+   Policy::signal_and_leave( *monitor, *queue );
+}
+// -----------------------------------------------------------------------------
+// returns number of threads waiting in the cond.var.
+
+template<class Policy> inline unsigned BasicCondVar<Policy>::get_nwt()
+{
+   assert( monitor != nullptr );
+   return monitor->get_nwt( *queue );
+}
+
+// *****************************************************************************
+//
+// ThreadIdentity, DeferredActions, VirtualTime and MonitorBase::defer: implementation
+//
+// *****************************************************************************
+
+inline ThreadIdentity & ThreadIdentity::current()
+{
+   // (a plain pointer: constant initialization, no thread local guard)
+   static thread_local ThreadIdentity * self = nullptr ;
+   if ( self == nullptr )
+      self = create();
+   return *self ;
+}
+// -----------------------------------------------------------------------------
+
+inline const std::string & ThreadIdentity::name() const
+{
+   static const std::string unknown( "(unknown)" );
+   const std::string * n = name_ptr.load( std::memory_order_acquire );
+   return n != nullptr ? *n : unknown ;
+}
+// -----------------------------------------------------------------------------
+
+inline DeferredActions & DeferredActions::current()
+{
+   static thread_local DeferredActions actions ;
+   return actions ;
+}
+// -----------------------------------------------------------------------------
+// register an action (the callable object is moved or copied into a slot)
+
+template<class F> inline void DeferredActions::add( F && action )
+{
+   typedef typename std::decay<F>::type Action ;
+   static_assert( sizeof( Action ) <= max_action_size,
+                  "deferred action too large (capture less data, or pointers)" );
+   static_assert( alignof( Action ) <= alignof( std::max_align_t ),
+                  "deferred action over-aligned" );
+
+   // the buffer is full: run the action now
+   if ( count == max_actions )
+   {
+      action();
+      return ;
+   }
+
+   Slot & slot = slots[count] ;
+   new ( slot.storage ) Action( std::forward<F>( action ) );
+   slot.invoke  = []( void * p ) { ( *static_cast<Action *>( p ) )(); } ;
+   slot.destroy = []( void * p ) { static_cast<Action *>( p )->~Action(); } ;
+   slot.relocate = []( void * from, void * to )
+   {
+      Action * a = static_cast<Action *>( from );
+      new ( to ) Action( std::move( *a ) );
+      a->~Action();
+   } ;
+   count++ ;
+}
+// -----------------------------------------------------------------------------
+
+inline void DeferredActions::run_from( unsigned mark )
+{
+   // actions may call procedures of other monitors, which use (and restore)
+   // the slots after 'end'
+   const unsigned end = count ;
+   for( unsigned i = mark ; i < end ; i++ )
+      slots[i].invoke( slots[i].storage );
+   for( unsigned i = mark ; i < end ; i++ )
+      slots[i].destroy( slots[i].storage );
+   count = mark ;
+}
+// -----------------------------------------------------------------------------
+
+inline void DeferredActions::discard_from( unsigned mark )
+{
+   for( unsigned i = mark ; i < count ; i++ )
+      slots[i].destroy( slots[i].storage );
+   count = mark ;
+}
+// -----------------------------------------------------------------------------
+// (when 'other' is full, the remaining actions are run now, as 'add' does)
+
+inline void DeferredActions::move_to( DeferredActions & other, unsigned mark )
+{
+   for( unsigned i = mark ; i < count ; i++ )
+   {
+      if ( other.count == max_actions )
+      {
+         slots[i].invoke( slots[i].storage );
+         slots[i].destroy( slots[i].storage );
+         continue ;
+      }
+      Slot & to = other.slots[other.count++] ;
+      slots[i].relocate( slots[i].storage, to.storage );
+      to.invoke   = slots[i].invoke ;
+      to.destroy  = slots[i].destroy ;
+      to.relocate = slots[i].relocate ;
+   }
+   count = mark ;
+}
+// -----------------------------------------------------------------------------
+
+inline std::chrono::steady_clock::time_point VirtualTime::now()
+{
+   if ( ! active() )
+      return std::chrono::steady_clock::now();
+   return origin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                      std::chrono::nanoseconds( elapsed.load( std::memory_order_relaxed ) ) );
+}
+// -----------------------------------------------------------------------------
+
+template<class Rep, class Period>
+inline void VirtualTime::sleep_for( const std::chrono::duration<Rep,Period> & duration )
+{
+   sleep_until( now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>( duration ) );
+}
+// -----------------------------------------------------------------------------
+
+template<class F, class... Args>
+inline std::thread VirtualTime::spawn( F && function, Args &&... args )
+{
+   return spawn_body( std::bind( std::forward<F>( function ), std::forward<Args>( args )... ) );
+}
+// -----------------------------------------------------------------------------
+
+template<class F> inline void MonitorBase::defer( F && action )
+{
+   assert( is_running() );
+   assert( std::this_thread::get_id() == running_thread_id );
+   DeferredActions::current().add( std::forward<F>( action ) );
+}
+
+// *****************************************************************************
+//
+// BasicMonitor and BasicFixedMonitor: implementation
+//
+// *****************************************************************************
+
+template<class Policy> inline BasicMonitor<Policy>::~BasicMonitor()
+{
+#ifndef NDEBUG
+   for( auto & q : cond_queues )
+      assert( q.get_nwt() == 0 );
+#endif
+}
+// -----------------------------------------------------------------------------
+
+template<class Policy> inline
+typename BasicMonitor<Policy>::CondVar BasicMonitor<Policy>::newCondVar()
+{
+   cond_queues.emplace_back();                      // add threads queue to monitor
+   cond_queues.back().set_index( unsigned( cond_queues.size()-1 ) );
+   return CondVar( this, &( cond_queues.back() ) ); // built and return cond.var.
+}
+// -----------------------------------------------------------------------------
+
+template<unsigned N, class Policy> inline BasicFixedMonitor<N,Policy>::BasicFixedMonitor()
+:  next_cond( 0 )
+{
+   for( unsigned i = 0 ; i < N ; i++ )
+      cond_queues[i].set_index( i );
+}
+// -----------------------------------------------------------------------------
+
+template<unsigned N, class Policy> inline
+BasicFixedMonitor<N,Policy>::BasicFixedMonitor( const std::string & p_name )
+:  MonitorBase( p_name ),
+   next_cond( 0 )
+{
+   for( unsigned i = 0 ; i < N ; i++ )
+      cond_queues[i].set_index( i );
+}
+// -----------------------------------------------------------------------------
+
+template<unsigned N, class Policy> inline BasicFixedMonitor<N,Policy>::~BasicFixedMonitor()
+{
+   for( unsigned i = 0 ; i < N ; i++ )
+      assert( cond_queues[i].get_nwt() == 0 );
+}
+// -----------------------------------------------------------------------------
+
+template<unsigned N, class Policy> template<unsigned I> inline
+typename BasicFixedMonitor<N,Policy>::CondVar BasicFixedMonitor<N,Policy>::condVar()
+{
+   static_assert( I < N, "condition variable index out of range" );
+   return CondVar( this, &( cond_queues[I] ) );
+}
+// -----------------------------------------------------------------------------
+
+template<unsigned N, class Policy> inline
+typename BasicFixedMonitor<N,Policy>::CondVar BasicFixedMonitor<N,Policy>::condVar( unsigned i )
+{
+   assert( i < N );
+   return CondVar( this, &( cond_queues[i] ) );
+}
+// -----------------------------------------------------------------------------
+
+template<unsigned N, class Policy> inline
+typename BasicFixedMonitor<N,Policy>::CondVar BasicFixedMonitor<N,Policy>::newCondVar()
+{
+   assert( next_cond < N );
+   return condVar( next_cond++ );
+}
+
+// *****************************************************************************
+//
+// Signal policies: implementation (inline, the monitor calls are not virtual)
+//
+// *****************************************************************************
+
+inline void SignalUrgentWait::signal( MonitorBase & m, ThreadsQueue & queue )
+{
+   m.signal_urgent( queue );
+}
+// -----------------------------------------------------------------------------
+// signal, one after the other, the threads waiting when called (a thread
+// which waits again on the same variable is not signalled twice)
+
+inline void SignalUrgentWait::signal_all( MonitorBase & m, ThreadsQueue & queue )
+{
+   for( unsigned n = m.get_nwt( queue ) ; 0 < n ; n-- )
+      m.signal_urgent( queue );
+}
+// -----------------------------------------------------------------------------
+
+inline void SignalUrgentWait::signal_and_leave( MonitorBase & m, ThreadsQueue & queue )
+{
+   m.signal_urgent_and_leave( queue );
+}
+// -----------------------------------------------------------------------------
+
+inline void SignalContinue::signal( MonitorBase & m, ThreadsQueue & queue )
+{
+   m.signal_continue( queue, false );
+}
+// -----------------------------------------------------------------------------
+
+inline void SignalContinue::signal_all( MonitorBase & m, ThreadsQueue & queue )
+{
+   m.signal_continue( queue, true );
+}
+// -----------------------------------------------------------------------------
+
+inline void SignalContinue::signal_and_leave( MonitorBase & m, ThreadsQueue & queue )
+{
+   m.signal_continue( queue, false );
+   m.leave_early();
+}
+
+// *****************************************************************************
+//
+// Monitor events trace
+//
+// With TRAZA_M defined (when compiling both the monitors and the programs),
+// every thread records the monitor events in its own ring buffer: no locks
+// and no output while running (the oldest records are overwritten when the
+// buffer is full). Each record has a time stamp, the monitor and condition
+// variable identifiers, and an event argument.
+//
+// The buffers are written to a binary file at exit, on SIGINT or SIGTERM, or
+// by calling 'trace_dump'. The file is named by the environment variable
+// TRAZA_M_FICHERO (default "traza_m.bin"), and the 'traza_su' program
+// converts it to a text timeline or to Chrome/Perfetto trace JSON.
+//
+// File layout (host byte order): a TraceFileHeader, 'num_monitors' monitor
+// entries, and 'num_threads' thread entries, each one followed by its
+// 'num_records' records (in time order).
+//
+// *****************************************************************************
+
+enum TraceEventKind : uint16_t
+{
+   trace_enter_request = 0, // calls a procedure with the monitor busy
+   trace_enter,             // gets the monitor (arg: 1 if it was busy)
+   trace_leave,             // leaves the monitor
+   trace_wait,              // waits on a condition variable
+   trace_resume,            // ... runs again after a signal
+   trace_timeout,           // ... runs again after the wait timed out
+   trace_signal,            // signals a condition variable (arg: threads signalled)
+   trace_urgent,            // waits in the urgent queue after a signal
+   trace_urgent_resume,     // ... runs again
+   trace_num_kinds
+} ;
+
+static const unsigned trace_name_size = 32 ;
+static const char     trace_magic[8]  = { 'H','M','T','R','A','Z','A','1' } ;
+
+struct TraceRecord
+{
+   uint64_t ticks ;      // time stamp, in ticks (see 'ns_per_tick')
+   uint32_t monitor ;    // monitor identifier
+   uint32_t arg ;        // event argument
+   uint16_t kind ;       // a TraceEventKind
+   uint16_t cond ;       // condition variable index (wait, signal)
+   uint32_t reserved ;
+} ;
+
+struct TraceFileHeader
+{
+   char     magic[8] ;       // 'trace_magic'
+   double   ns_per_tick ;    // nanoseconds per time stamp tick
+   uint32_t num_monitors ;
+   uint32_t num_threads ;
+} ;
+
+struct TraceMonitorEntry
+{
+   uint32_t monitor ;
+   char     name[trace_name_size] ;
+   uint32_t reserved ;
+} ;
+
+struct TraceThreadEntry
+{
+   uint32_t thread ;         // thread number, in order of the first event
+   uint32_t num_records ;
+   char     name[trace_name_size] ;  // registered name (see register_thread_name)
+} ;
+
+inline const char * trace_kind_name( unsigned kind )
+{
+   static const char * const names[trace_num_kinds] =
+      { "enter_request", "enter", "leave", "wait", "resume", "timeout",
+        "signal", "urgent", "urgent_resume" } ;
+   return kind < trace_num_kinds ? names[kind] : "unknown" ;
+}
+
+#ifdef TRAZA_M
+// write the trace file now (returns false if it could not be written)
+bool trace_dump( const char * path );
+#endif
+
 // *****************************************************************************
 extern std::mutex mcout ;
 
@@ -205,7 +1318,6 @@ template<class MonClass> class MRef
    {
       assert( p_monPtr != nullptr );
       monPtr = p_monPtr ;
-      logM( "inicio MRef( monitor * )  : rc == " << monPtr->reference_count  );
    }
 
    // obtain a call proxy through the dereference operator
@@ -214,17 +1326,116 @@ template<class MonClass> class MRef
      assert( monPtr != nullptr );
      return Call_proxy<MonClass>( *monPtr ) ; // acquires mutual exclusion
    }
+
+   // run 'f( monitor )' in a single entry to the monitor: any sequence of
+   // procedure calls (and condition waits) in 'f' runs as one atomic step,
+   // with a single enter/leave pair, for example:
+   //
+   //    estanco.with( [&lote]( Estanco & e ) { if ( e.esperarHuecos( lote.size() ) ) e.ponerIngredientes( lote ); } );
+   //
+   // A 'signal_and_leave' must be the last operation in 'f' (it leaves the monitor).
+   template<class F>
+   inline auto with( F && f ) -> decltype( f( std::declval<MonClass &>() ) )
+   {
+     assert( monPtr != nullptr );
+     Call_proxy<MonClass> proxy( *monPtr ) ;  // acquires mutual exclusion until 'f' returns
+     return f( *monPtr );
+   }
+
+   // queue 'f( monitor )' to be run in the monitor by its executor thread,
+   // without waiting for it: the calling thread keeps going, and the returned
+   // future gives the result. The calls queued for a monitor run one after
+   // the other, in order, each one in its own entry: 'f' may wait on
+   // conditions (the calls queued after it wait meanwhile). For example:
+   //
+   //    MonitorFuture<bool> puesto = estanco.async( [ing]( Estanco & e ) { .... } );
+   //    .... (the thread keeps going)
+   //    if ( ! puesto.get() ) ....
+   template<class F>
+   inline MonitorFuture< decltype( std::declval<F &>()( std::declval<MonClass &>() ) ) > async( F && f )
+   {
+     typedef decltype( std::declval<F &>()( std::declval<MonClass &>() ) ) Result ;
+     assert( monPtr != nullptr );
+
+     std::shared_ptr< AsyncCallOf<Result,MonClass,F> > call =
+        std::make_shared< AsyncCallOf<Result,MonClass,F> >( monPtr, std::forward<F>( f ) );
+     monPtr->submit_async( call );
+     return MonitorFuture<Result>( call );
+   }
+
+   // run 'f( monitor )' in the monitor, as a combined call (flat combining):
+   // it may be run by another thread, the one in the monitor when it is
+   // published, together with other combined calls. It suits short procedures
+   // called by many threads at once, for example:
+   //
+   //    bool descansar = barberia.combine( [i]( Barberia & b ) { return b.finCliente( i ); } );
+   //
+   // The thread leaving the monitor (through any call) runs the published
+   // calls first. A call which waits on a condition is given back to its
+   // thread, which runs it again as a normal call (and so it may wait as
+   // usual): the procedure must not signal before its first 'wait', and the
+   // changes it makes before waiting are made again. Its deferred actions are
+   // run by the calling thread. A 'signal_and_leave' run by another thread
+   // just signals, and that thread keeps the monitor.
+   template<class F>
+   inline auto combine( F && f ) -> decltype( f( std::declval<MonClass &>() ) )
+   {
+     typedef decltype( f( std::declval<MonClass &>() ) ) Result ;
+     assert( monPtr != nullptr );
+
+     MonClass &             mon = *monPtr ;
+     CombinedResult<Result> result ;
+     auto body = [&]() { result.run( f, mon ); } ;
+
+     CombinedCall call ;
+     call.invoke   = []( void * p ) { ( *static_cast<decltype( body ) *>( p ) )(); } ;
+     call.callable = &body ;
+
+     // (as a call proxy) run the actions deferred by the calls after leaving
+     DeferredActions & deferred = DeferredActions::current() ;
+     call.deferred = &deferred ;
+     const unsigned    mark     = deferred.size() ;
+     mon.call_combined( call );
+     if ( mark < deferred.size() )
+        deferred.run_from( mark );
+     return result.get();
+   }
 } ;
 
 // -----------------------------------------------------------------------------
 // creation of a monitor reference by using a list of
 // actual parameters (the list must match a monitor constructor parameters list)
 
+// allocator of memory aligned to a cache line: in C++11 'new' (and so
+// 'make_shared') ignores alignments larger than that of max_align_t
+
+template< class T > struct LineAllocator
+{
+   typedef T value_type ;
+
+   LineAllocator() {}
+   template< class U > LineAllocator( const LineAllocator<U> & ) {}
+
+   T * allocate( std::size_t n )
+   {
+      void * p = nullptr ;
+      if ( posix_memalign( &p, cache_line_size, n*sizeof(T) ) != 0 )
+         throw std::bad_alloc() ;
+      return static_cast<T *>( p );
+   }
+   void deallocate( T * p, std::size_t ) { free( p ); }
+} ;
+
+template< class T, class U > inline
+bool operator == ( const LineAllocator<T> &, const LineAllocator<U> & ) { return true ; }
+template< class T, class U > inline
+bool operator != ( const LineAllocator<T> &, const LineAllocator<U> & ) { return false ; }
+
 template< class MonClass, class... Args > inline
 MRef<MonClass> Create( Args &&... args )
 {
-   // equivalent to 'new'
-   return MRef<MonClass>( make_shared<MonClass>( args... ) );
+   // equivalent to 'new' (with the monitor aligned to a cache line)
+   return MRef<MonClass>( allocate_shared<MonClass>( LineAllocator<MonClass>(), args... ) );
 }
 
 // *****************************************************************************
@@ -236,12 +1447,25 @@ MRef<MonClass> Create( Args &&... args )
 template<class MonClass> class Call_proxy
 {
    private:
-   MonClass & monRef ; // monitor reference
+   MonClass & monRef ;        // monitor reference
+   unsigned   deferred_mark ; // deferred actions registered before the call
 
    public:
-   inline Call_proxy( MonClass & mr ) : monRef(mr) { monRef.enter(); }
+   inline Call_proxy( MonClass & mr )
+   :  monRef( mr ),
+      deferred_mark( DeferredActions::current().size() )
+   {
+      monRef.enter();
+   }
    inline MonClass * operator -> () { return &monRef; }
-   inline ~Call_proxy() { monRef.leave(); }
+   inline ~Call_proxy()
+   {
+      monRef.leave();
+      // run the actions deferred by the procedure, outside of the monitor
+      DeferredActions & deferred = DeferredActions::current() ;
+      if ( deferred_mark < deferred.size() )
+         deferred.run_from( deferred_mark );
+   }
 };
 
 } // namespace HW end
@@ -0,0 +1,411 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/resource.h>   // getrusage
+#include "CoMonitor.hpp"
+#include "AsyncLog.hpp"
+
+using namespace HM;
+using namespace std;
+
+// Barbería con corrutinas (C++20): cada cliente y cada barbero es una corrutina,
+// y un conjunto fijo de hebras las ejecuta (ver CoMonitor.hpp). El monitor
+// tiene semántica Hoare, como barberia_su.
+
+//Variables globales (configurables desde la línea de órdenes, ver 'uso')------
+int
+  num_clientes = 7,            // número de clientes
+  num_barberos = 2,            // número de barberos
+  max_clientes = 3,            // número maximo de clientes que puede despachar un barbero sin descansar
+  tamanio_sala = 5,            // número maximo de clientes esperando en la sala de espera
+  paciencia_cliente = 400,     // milisegundos que un cliente aguanta en la sala de espera
+  intervalo_limpieza = 1500;   // milisegundos que duerme un barbero sin clientes antes de limpiar
+unsigned
+  num_hebras = 0;              // hebras que ejecutan las corrutinas (0: una por procesador)
+double
+  duracion = 0;                // segundos hasta terminar (0: sin límite)
+unsigned long
+  objetivo = 0;                // cortes de pelo hasta terminar (0: sin límite)
+bool
+  sin_salida = false;          // modo de carga: sin esperas ni mensajes
+
+//Mensajes del programa (ninguno en el modo de carga: una línea nula)-----------
+inline LogLine mensaje(){
+  return async_log(!sin_salida);
+}
+
+//Generador de números aleatorios (uno por hebra)-------------------------------
+int aleatorio(int min, int max){
+  static thread_local default_random_engine generador( (random_device())() );
+  return uniform_int_distribution<int>( min, max )( generador );
+}
+
+//Funciones espera--------------------------------------------------------------
+// En el modo de carga el cliente solo cede su hebra a las demás corrutinas
+CoTask<> esperarFueraBarberia(int i){
+  if (sin_salida) {
+    co_await CoPool::sleep_for(chrono::milliseconds(0));
+    co_return;
+  }
+
+  chrono::milliseconds duracion_esperar( aleatorio(500, 600) );
+
+  mensaje() << std::string( 15, ' ' )
+    << " Cliente" << i
+      << ": Creciendole el pelo...";
+  co_await CoPool::sleep_for( duracion_esperar );
+  mensaje() << std::string( 15, ' ' )
+    << " Cliente" << i
+      << ": Me ha crecido el pelo, voy a pelarme";
+}
+
+CoTask<> cortarPeloACliente(int i){
+  if (sin_salida)
+    co_return;
+
+  chrono::milliseconds duracion_esperar( aleatorio(100, 200) );
+
+  mensaje() << "Barbero"<< i
+    << ": Pelando...";
+  co_await CoPool::sleep_for( duracion_esperar );
+  mensaje() << "Barbero"<< i
+    << ": Pelado listo";
+}
+
+//Monitor para gestionar el acceso a una barbería-------------------------------
+// Los procedimientos son corrutinas: entran con 'co_await enter()' y salen al
+// terminar (al destruirse 'dentro')
+class Barberia : public CoMonitor{
+private:
+  deque<int> barberos_libres;                  //Barberos esperando cliente, por orden de llegada
+  unsigned clientes_esperando;                 //Clientes en la sala de espera
+  vector<int> cliente_asignado;                //Cliente de cada barbero (-1 si no tiene)
+  vector<unsigned> clientes_x_barbero;
+  CoCondVar c_clientes, c_fin;                 //Condiciones
+  vector<CoCondVar> c_barbero, c_cliente_pelandose;
+
+  bool terminado;                              //Fin de la ejecución: las corrutinas salen de sus bucles
+  unsigned long total_cortes, cortes_al_fin;   //Los cortes en curso al terminar se acaban
+  vector<unsigned long> cortes_barbero,        //Contadores para el informe final
+                        cortes_cliente, rechazos_cliente, abandonos_cliente;
+  chrono::steady_clock::time_point inicio, fin;
+
+  CoTask<> finalizar();
+
+public:
+  Barberia();
+
+  CoTask<bool> siguienteCliente(int i);
+  CoTask<bool> cortarPelo(int i);
+  CoTask<bool> finCliente(int i);
+
+  CoTask<> esperarFin();
+  void informe();
+};
+
+//Implementación de los metodos de la barbería----------------------------------
+Barberia::Barberia()
+: CoMonitor("barberia") {
+  clientes_esperando = 0;
+  cliente_asignado.assign(num_barberos, -1);
+  clientes_x_barbero.assign(num_barberos, 0);
+  c_clientes = newCondVar();
+  for (int i = 0; i < num_barberos; i++) {
+    c_barbero.push_back(newCondVar());
+  }
+  for (int i = 0; i < num_barberos; i++) {
+    c_cliente_pelandose.push_back(newCondVar());
+  }
+  c_fin = newCondVar();
+
+  terminado = false;
+  total_cortes = cortes_al_fin = 0;
+  cortes_barbero.assign(num_barberos, 0);
+  cortes_cliente.assign(num_clientes, 0);
+  rechazos_cliente.assign(num_clientes, 0);
+  abandonos_cliente.assign(num_clientes, 0);
+  inicio = chrono::steady_clock::now();
+}
+
+CoTask<bool> Barberia::siguienteCliente(int i){
+  auto dentro = co_await enter();
+  if (terminado)
+    co_return false;
+  barberos_libres.push_back(i);                             //El barbero queda libre para el siguiente cliente
+  if (clientes_esperando == 0) {                            //Si no hay ningun cliente, el barbero se duerme
+    mensaje() << "Barbero" << i
+      << ": No hay ningun cliente, me duermo zzz...";
+    while (cliente_asignado[i] == -1 && !terminado) {
+      const bool despertado = co_await c_barbero[i].wait_for(chrono::milliseconds(intervalo_limpieza));
+      if (!despertado && cliente_asignado[i] == -1 && !terminado) {   //Nadie le ha despertado: limpia y vuelve a dormir
+        mensaje() << "Barbero" << i
+          << ": Sigue sin venir nadie, barro la barbería y vuelvo a dormir";
+      }
+    }
+    if (cliente_asignado[i] == -1)                          //Terminado sin cliente
+      co_return false;
+    mensaje() << "Barbero" << i
+      << ": Buenos días zzz... Pase pase";
+  }
+  else{
+    mensaje() << "Barbero" << i
+      << ": Que pase el siguiente cliente!";
+    co_await c_clientes.signal();                           //El barbero avisa al siguiente cliente para que pase
+    while (cliente_asignado[i] == -1 && !terminado)
+      co_await c_barbero[i].wait();
+    if (cliente_asignado[i] == -1)
+      co_return false;
+  }
+  co_return true;
+}
+
+CoTask<bool> Barberia::cortarPelo(int i) {
+  auto dentro = co_await enter();
+  if (terminado)
+    co_return false;
+  mensaje() << std::string( 15, ' ' )
+    << " Cliente" << i
+      << ": Buenos dias!";
+  if (barberos_libres.empty()) {
+    if (clientes_esperando >= unsigned(tamanio_sala)) {
+      mensaje() << std::string( 15, ' ' )
+        << "Cliente" << i
+          << ": Hay mucha cola, vuelvo luego!";
+      rechazos_cliente[i]++;
+      co_return true;
+    }
+    mensaje() << std::string( 15, ' ' )
+      << " Cliente" << i
+        << ": Entro a la sala de espera";                   //El cliente espera a que un barbero le de paso
+    clientes_esperando++;
+    const auto limite = chrono::steady_clock::now() + chrono::milliseconds(paciencia_cliente);
+    while (barberos_libres.empty() && !terminado) {
+      const bool avisado = co_await c_clientes.wait_until(limite);
+      if (!avisado && barberos_libres.empty() && !terminado) {   //Se acaba la paciencia
+        clientes_esperando--;
+        mensaje() << std::string( 15, ' ' )
+          << " Cliente" << i
+            << ": Llevo mucho esperando, me voy!";
+        abandonos_cliente[i]++;
+        co_return true;
+      }
+    }
+    clientes_esperando--;
+    if (terminado)
+      co_return false;
+  }
+  const int b = barberos_libres.front();                    //El cliente pasa con el primer barbero libre
+  barberos_libres.pop_front();
+  cliente_asignado[b] = i;
+  co_await c_barbero[b].signal();                           //El cliente despierta al barbero en caso de que este dormido
+  mensaje() << std::string( 15, ' ' )
+    << " Cliente" << i << ": Pelándose...";
+  while (cliente_asignado[b] == i)
+    co_await c_cliente_pelandose[b].wait();                 //El cliente espera a que el barbero le pele
+  mensaje() << std::string( 15, ' ' )
+    << " Cliente" << i
+      << ": Perfecto! Hasta luego!";
+  cortes_cliente[i]++;
+  co_return true;
+}
+
+CoTask<bool> Barberia::finCliente(int i){
+  auto dentro = co_await enter();
+  clientes_x_barbero[i]++;
+  mensaje() << "Barbero"<< i
+    << ": Listo, le gusta como ha quedado?";
+  cliente_asignado[i] = -1;
+
+  const bool descansar = clientes_x_barbero[i] >= unsigned(max_clientes);
+  if(descansar)
+    clientes_x_barbero[i] = 0;
+
+  cortes_barbero[i]++;
+  if (++total_cortes == objetivo)
+    co_await finalizar();                                   //Antes del signal_and_leave, que ha de ser lo último
+
+  c_cliente_pelandose[i].signal_and_leave(dentro);           //El cliente ha sido pelado y sale de la barbería
+  co_return descansar;
+}
+
+// Marca el fin y despierta a todas las corrutinas bloqueadas en el monitor
+// (el cliente que se está pelando sale cuando su barbero acaba)
+CoTask<> Barberia::finalizar(){
+  if (terminado)
+    co_return;
+  terminado = true;
+  fin = chrono::steady_clock::now();
+  cortes_al_fin = total_cortes;
+  co_await c_clientes.signal_all();
+  for (auto & c : c_barbero)
+    co_await c.signal_all();
+  co_await c_fin.signal_all();
+}
+
+// Espera hasta alcanzar el objetivo o hasta que se agote la duración
+CoTask<> Barberia::esperarFin(){
+  auto dentro = co_await enter();
+  if (duracion > 0) {
+    const auto limite = inicio + chrono::duration_cast<chrono::steady_clock::duration>(
+                                   chrono::duration<double>(duracion));
+    while (!terminado) {
+      const bool avisado = co_await c_fin.wait_until(limite);
+      if (!avisado)                                         //Se acaba el tiempo
+        break;
+    }
+  }
+  else {
+    while (!terminado)
+      co_await c_fin.wait();
+  }
+  co_await finalizar();
+}
+
+// (al final, sin corrutinas en ejecución)
+void Barberia::informe(){
+  const double segundos = chrono::duration<double>(fin - inicio).count();
+  unsigned long rechazos = 0, abandonos = 0;
+  for (int i = 0; i < num_clientes; i++) {
+    rechazos += rechazos_cliente[i];
+    abandonos += abandonos_cliente[i];
+  }
+  cout << "Tiempo: " << fixed << setprecision(3) << segundos << " s" << endl
+       << "Cortes de pelo: " << total_cortes << " ("
+         << setprecision(1) << cortes_al_fin / segundos << " por segundo)" << endl
+       << "Clientes rechazados (sala llena): " << rechazos << endl
+       << "Clientes que se cansan de esperar: " << abandonos << endl
+       << "Traspasos del monitor: " << get_handoffs() << " ("
+         << get_handoffs() / segundos << " por segundo)" << endl;
+  for (int i = 0; i < num_barberos; i++)
+    cout << "  Barbero" << i << ": " << cortes_barbero[i] << " cortes" << endl;
+  if (num_clientes <= 20) {
+    for (int i = 0; i < num_clientes; i++)
+      cout << "  Cliente" << i << ": " << cortes_cliente[i] << " cortes, "
+           << rechazos_cliente[i] << " rechazos, " << abandonos_cliente[i] << " abandonos" << endl;
+  }
+  else {                                                    //Demasiados para listarlos
+    const auto mm = minmax_element(cortes_cliente.begin(), cortes_cliente.end());
+    cout << "  Cortes por cliente: entre " << *mm.first << " y " << *mm.second << endl;
+  }
+}
+
+//Corrutinas de cliente y barbero-----------------------------------------------
+// (g++ 12: el resultado de co_await, en una variable antes de usarlo en una condición)
+CoTask<> cliente(Barberia & barberia, int i){
+  for (;;) {
+    const bool seguir = co_await barberia.cortarPelo(i);     //Ir a cortarse el pelo
+    if (!seguir)
+      break;
+    co_await esperarFueraBarberia(i);
+  }
+}
+
+CoTask<> barbero(Barberia & barberia, int i){
+  for (;;) {
+    const bool seguir = co_await barberia.siguienteCliente(i);
+    if (!seguir)
+      break;
+    co_await cortarPeloACliente(i);
+    const bool descansar = co_await barberia.finCliente(i);
+    if(descansar && !sin_salida){
+      mensaje() << "Barbero" << i
+        << ": Estoy muy cansado, voy a descansar un ratito";
+      co_await CoPool::sleep_for(std::chrono::seconds(2));
+
+      mensaje() << "Barbero" << i
+        << ": Ya he descansado, a trabajar!";
+    }
+  }
+}
+
+CoTask<> cronometro(Barberia & barberia){
+  co_await barberia.esperarFin();
+}
+
+//Opciones de la línea de órdenes-----------------------------------------------
+void uso(const char * prog) {
+  cerr << "uso: " << prog << " [-c clientes] [-b barberos] [-m max_clientes] [-s tamanio_sala]" << endl
+       << "          [-p paciencia_ms] [-l limpieza_ms] [-w hebras] [-d segundos] [-n cortes] [-q]" << endl
+       << "   -w    : hebras que ejecutan las corrutinas (por defecto, una por procesador)" << endl
+       << "   -d, -n: terminar tras ese tiempo o ese número de cortes de pelo, e informar" << endl
+       << "   -q    : modo de carga, sin esperas ni mensajes (5 segundos si no hay -d ni -n)" << endl;
+  exit(1);
+}
+
+void leerOpciones(int argc, char const *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const string opt = argv[i];
+    if (opt == "-q")
+      sin_salida = true;
+    else {
+      if (i+1 >= argc)
+        uso(argv[0]);
+      const char * val = argv[++i];
+      if (opt == "-c")
+        num_clientes = atoi(val);
+      else if (opt == "-b")
+        num_barberos = atoi(val);
+      else if (opt == "-m")
+        max_clientes = atoi(val);
+      else if (opt == "-s")
+        tamanio_sala = atoi(val);
+      else if (opt == "-p")
+        paciencia_cliente = atoi(val);
+      else if (opt == "-l")
+        intervalo_limpieza = atoi(val);
+      else if (opt == "-w")
+        num_hebras = unsigned(atoi(val));
+      else if (opt == "-d")
+        duracion = atof(val);
+      else if (opt == "-n")
+        objetivo = strtoul(val, nullptr, 10);
+      else
+        uso(argv[0]);
+    }
+  }
+  if (num_clientes < 1 || num_barberos < 1 || max_clientes < 1 || tamanio_sala < 0
+      || paciencia_cliente < 0 || intervalo_limpieza < 1 || duracion < 0)
+    uso(argv[0]);
+  if (sin_salida && duracion == 0 && objetivo == 0)
+    duracion = 5;
+  if (num_hebras == 0)
+    num_hebras = max(1u, thread::hardware_concurrency());
+}
+
+//Función principal-------------------------------------------------------------
+int main(int argc, char const *argv[]) {
+  leerOpciones(argc, argv);
+
+  mensaje() << "------------------------------------" << endl
+       << "Problema de la barberia (corrutinas)." << endl
+       << "------------------------------------";
+
+  CoPool pool(num_hebras);
+  Barberia barberia;
+
+  for (int i = 0; i < num_barberos; i++) {
+    pool.spawn(barbero(barberia, i));
+  }
+  for (int i = 0; i < num_clientes; i++) {
+    pool.spawn(cliente(barberia, i));
+  }
+  if (duracion > 0 || objetivo > 0)
+    pool.spawn(cronometro(barberia));                       //Sin límites el programa no termina nunca
+
+  pool.run();                                               //Hasta que terminan todas las corrutinas
+
+  AsyncLog::instance().flush();                             //Los mensajes pendientes, antes del informe
+  barberia.informe();
+
+  struct rusage uso_recursos;
+  getrusage(RUSAGE_SELF, &uso_recursos);
+  cout << "Hebras: " << num_hebras << ", memoria máxima: "
+       << uso_recursos.ru_maxrss / 1024 << " MiB" << endl;
+  return 0;
+}
@@ -3,218 +3,622 @@
 #include <random>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
 #include "HoareMonitor.hpp"
+#include "AsyncLog.hpp"
 
 using namespace HM;
 
-//Variables globales------------------------------------------------------------
-constexpr int
+//Variables globales (configurables desde la línea de órdenes, ver 'uso')------
+int
   num_clientes = 7,            // número de clientes
-  num_barberos = 2,            // número de barberos
+  num_barberos = 2,            // número de barberos de cada barbería
+  num_barberias = 1,           // número de barberías, cada una con sus barberos y su sala
   max_clientes = 3,            // número maximo de clientes que puede despachar un barbero sin descansar
-  tamanio_sala = 5;            // número maximo de clientes esperando en la sala de espera
-mutex
-  mtx ;                        // mutex de escritura en pantalla
+  tamanio_sala = 5,            // número maximo de clientes esperando en la sala de cada barbería
+  paciencia_cliente = 400,     // milisegundos que un cliente aguanta en la sala de espera
+  intervalo_limpieza = 1500;   // milisegundos que duerme un barbero sin clientes antes de limpiar
+double
+  duracion = 0;                // segundos hasta terminar (0: sin límite)
+unsigned long
+  objetivo = 0;                // cortes de pelo hasta terminar (0: sin límite)
+long
+  semilla = -1;                // semilla de los generadores aleatorios (-1: aleatoria)
+bool
+  sin_salida = false,          // modo de carga: sin esperas ni mensajes
+  tiempo_virtual = false,      // simulación con tiempo virtual (ver VirtualTime)
+  estadisticas = false;        // escribir las estadísticas del monitor al terminar
 
-//Generador de números aleatorios-----------------------------------------------
-template< int min, int max > int aleatorio(){
-  static default_random_engine generador( (random_device())() );
-  static uniform_int_distribution<int> distribucion_uniforme( min, max ) ;
-  return distribucion_uniforme( generador );
+//Mensajes del programa (ninguno en el modo de carga: una línea nula)-----------
+inline LogLine mensaje(){
+  return async_log(!sin_salida);
+}
+
+//Semántica de los monitores: Hoare por defecto, Mesa con -DSEMANTICA_MESA------
+#ifdef SEMANTICA_MESA
+typedef SignalContinue Semantica;
+#else
+typedef SignalUrgentWait Semantica;
+#endif
+
+//Generador de números aleatorios (uno por hebra)-------------------------------
+// Con -r la semilla de cada hebra es fija: con tiempo virtual, la ejecución se repite
+unsigned semillaHebra(){
+  if (semilla < 0)
+    return (random_device())();
+  return unsigned(semilla) + ThreadIdentity::current().id();
+}
+
+int aleatorio(int min, int max){
+  static thread_local default_random_engine generador( semillaHebra() );
+  return uniform_int_distribution<int>( min, max )( generador );
+}
+
+//En el modo de carga no hay esperas, salvo con tiempo virtual (no cuestan nada)
+bool sinEsperas(){
+  return sin_salida && !tiempo_virtual;
+}
+
+//Nombre de un barbero en los mensajes: con varias barberías, Barbero<barbería>.<i>
+string nombreBarbero(int tienda, int i){
+  return "Barbero" + (num_barberias > 1 ? to_string(tienda) + "." : string()) + to_string(i);
 }
 
 //Funciones espera--------------------------------------------------------------
 void esperarFueraBarberia(int i){
-  chrono::milliseconds duracion_esperar( aleatorio<500,600>() );
+  if (sinEsperas())
+    return;
 
-  mtx.lock();
-  std::cout << std::string( 15, ' ' )
+  chrono::milliseconds duracion_esperar( aleatorio(500, 600) );
+
+  mensaje() << std::string( 15, ' ' )
     << " Cliente" << i
-      << ": Creciendole el pelo..."
-        << endl;
-  mtx.unlock();
-  this_thread::sleep_for( duracion_esperar );
-  mtx.lock();
-  std::cout << std::string( 15, ' ' )
+      << ": Creciendole el pelo...";
+  VirtualTime::sleep_for( duracion_esperar );
+  mensaje() << std::string( 15, ' ' )
     << " Cliente" << i
-      << ": Me ha crecido el pelo, voy a pelarme"
-        << endl;
-  mtx.unlock();
+      << ": Me ha crecido el pelo, voy a pelarme";
 }
 
-void cortarPeloACliente(int i){
-  chrono::milliseconds duracion_esperar( aleatorio<100,200>() );
+void cortarPeloACliente(int tienda, int i){
+  if (sinEsperas())
+    return;
+
+  chrono::milliseconds duracion_esperar( aleatorio(100, 200) );
 
-  mtx.lock();
-  std::cout << "Barbero"<< i
-    << ": Pelando..." << endl;
-  mtx.unlock();
-  this_thread::sleep_for( duracion_esperar );
-  mtx.lock();
-  std::cout << "Barbero"<< i
-    << ": Pelado listo" << endl;
-  mtx.unlock();
+  mensaje() << nombreBarbero(tienda, i)
+    << ": Pelando...";
+  VirtualTime::sleep_for( duracion_esperar );
+  mensaje() << nombreBarbero(tienda, i)
+    << ": Pelado listo";
 }
 
 //Monitor para gestionar el acceso a una barbería-------------------------------
-class Barberia : public HoareMonitor{
+// Válido con semántica Hoare y Mesa: cada espera comprueba su condición en un
+// bucle, y el cliente elige barbero en lugar de leer un barbero compartido
+// El número de barberos se conoce al arrancar: colas de condición dinámicas
+// Cada barbero tiene su propia cola en la sala de espera: el cliente que llega
+// pasa con el barbero que lleva más tiempo libre o, si no hay ninguno, se pone
+// en la cola del que antes acabará (ver finEstimado); el barbero que se queda
+// sin clientes en su cola atiende a los de las demás (ver siguienteCliente)
+// Con varias barberías cada una es un monitor independiente; los clientes
+// llegan por una recepción común (ver irABarberia)
+
+// Resultado de la visita de un cliente a una barbería
+enum Visita { visita_pelado, visita_abandono, visita_sala_llena, visita_cerrada };
+
+void terminarBarberias();
+atomic<unsigned long> cortes_totales( 0 );                 //Cortes de todas las barberías (para -n)
+
+class Barberia : public BasicMonitor<Semantica>{
 private:
-  int siguiente_barbero;
-  unsigned clientes_x_barbero[num_barberos];
-  CondVar c_clientes, c_barbero, c_cliente_pelandose[num_barberos];   //Condiciones
+  const int tienda;                            //Número de la barbería
+  atomic<unsigned> & ocupacion;                //Copia de clientes_dentro para la recepción
+  unsigned clientes_dentro;                    //Clientes en la sala o pelándose
+  vector<deque<int>> cola;                     //Clientes en la cola de cada barbero, por orden de llegada
+  unsigned clientes_esperando;                 //Clientes en la sala de espera (en todas las colas)
+  deque<int> barberos_libres;                  //Barberos esperando cliente, por orden de llegada
+  vector<bool> descansando;                    //El barbero está descansando
+  vector<int> cliente_asignado;                //Cliente de cada barbero (-1 si no tiene)
+  vector<int> barbero_cliente;                 //Barbero que atiende a cada cliente (-1 si espera o no está)
+  vector<int> cola_cliente;                    //Cola en la que espera cada cliente
+  vector<unsigned> clientes_x_barbero;
+  CondVar c_fin;                               //Condiciones
+  vector<CondVar> c_barbero, c_cliente_pelandose, c_turno;
+
+  bool terminado;                              //Fin de la ejecución: las hebras salen de sus bucles
+  unsigned long total_cortes, cortes_al_fin;   //Los cortes en curso al terminar se acaban
+  unsigned long abandonos;                     //Clientes que se cansan de esperar
+  unsigned long robos;                         //Clientes atendidos por un barbero que no era el de su cola
+  vector<unsigned long> cortes_barbero;        //Contadores para el informe final
+  Histogram esperas;                           //Esperas en la sala de los clientes atendidos
+  vector<chrono::steady_clock::time_point> llegada;  //Llegada de cada cliente a la sala
+  chrono::steady_clock::time_point inicio, fin;
+
+  void finalizar();
+  void cambiarOcupacion(int cambio);
+  unsigned finEstimado(int b) const;
+  int elegirBarbero() const;
+
 public:
-  Barberia();
+  Barberia(int tienda, atomic<unsigned> * ocupacion);
 
-  void siguienteCliente(int i);
-  void cortarPelo(int i);
+  bool siguienteCliente(int i);
+  Visita cortarPelo(int i);
   bool finCliente(int i);
+
+  void terminar();
+  void esperarFin();
+  double cortesPorSegundo();
+  void informe();
 };
 
 //Implementación de los metodos de la barbería----------------------------------
-Barberia::Barberia(){
-  siguiente_barbero = -1;
-  for (size_t i = 0; i < num_barberos; i++) {
-    clientes_x_barbero[i] = 0;
-    c_cliente_pelandose[i] = newCondVar();
-  }
-  c_clientes = newCondVar();
-  c_barbero = newCondVar();
-}
-
-void Barberia::siguienteCliente(int i){
-  if (c_clientes.get_nwt() == 0) {                          //Si no hay ningun cliente, el barbero se duerme
-    mtx.lock();
-    std::cout << "Barbero" << i
-      << ": No hay ningun cliente, me duermo zzz..."
-        << endl;
-    mtx.unlock();
-    c_barbero.wait();
-    mtx.lock();
-    std::cout << "Barbero" << i
-      << ": Buenos días zzz... Pase pase"
-        << endl;
-    mtx.unlock();
-    siguiente_barbero = i;
-  }
-  else{
-    mtx.lock();
-    std::cout << "Barbero" << i
-      << ": Que pase el siguiente cliente!"
-        << endl;
-    mtx.unlock();
-    siguiente_barbero = i;
-    c_clientes.signal();                                    //El barbero avisa al siguiente cliente para que pase
-  }
-}
-
-void Barberia::cortarPelo(int i) {
-  mtx.lock();
-  std::cout << std::string( 15, ' ' )
-    << " Cliente" << i
-      << ": Buenos dias!" << endl;
-  mtx.unlock();
-  if (c_barbero.get_nwt() != 0)
-    c_barbero.signal();                                     //El cliente despierta al barbero en caso de que este dormido
-  else{
-    if (c_clientes.get_nwt() >= tamanio_sala) {
-      mtx.lock();
-      std::cout << std::string( 15, ' ' )
-        << "Cliente" << i
-          << ": Hay mucha cola, vuelvo luego!"
-            << endl;
-      mtx.unlock();
-      return;
+Barberia::Barberia(int tienda, atomic<unsigned> * ocupacion)
+: BasicMonitor<Semantica>("barberia"), tienda(tienda), ocupacion(*ocupacion) {
+  clientes_dentro = 0;
+  cola.resize(num_barberos);
+  clientes_esperando = 0;
+  descansando.assign(num_barberos, false);
+  cliente_asignado.assign(num_barberos, -1);
+  barbero_cliente.assign(num_clientes, -1);
+  cola_cliente.assign(num_clientes, -1);
+  clientes_x_barbero.assign(num_barberos, 0);
+  for (int i = 0; i < num_barberos; i++) {
+    c_barbero.push_back(newCondVar());
+  }
+  for (int i = 0; i < num_barberos; i++) {
+    c_cliente_pelandose.push_back(newCondVar());
+  }
+  for (int i = 0; i < num_clientes; i++) {
+    c_turno.push_back(newCondVar());
+  }
+  c_fin = newCondVar();
+
+  terminado = false;
+  total_cortes = cortes_al_fin = 0;
+  abandonos = robos = 0;
+  cortes_barbero.assign(num_barberos, 0);
+  llegada.resize(num_clientes);
+  inicio = VirtualTime::now();
+}
+
+// Entra (+1) o sale (-1) un cliente: la recepción lee la ocupación sin entrar
+// en el monitor, así que basta con que le llegue un poco tarde
+void Barberia::cambiarOcupacion(int cambio) {
+  clientes_dentro += cambio;
+  ocupacion.store(clientes_dentro, memory_order_relaxed);
+}
+
+// Cortes de pelo que tardará el barbero b en atender a un cliente nuevo: los
+// de su cola, el que está pelando y los descansos que le tocarán mientras tanto
+// (un descanso de 2 segundos equivale a unos 13 cortes de 100 a 200 ms)
+unsigned Barberia::finEstimado(int b) const {
+  const unsigned cortes_x_descanso = 13;
+  const unsigned cortes = cola[b].size() + (cliente_asignado[b] != -1 ? 1 : 0);
+  if (sinEsperas())                                         //No hay descansos
+    return cortes;
+  const unsigned descansos = (descansando[b] ? 1 : 0) + (clientes_x_barbero[b] + cortes) / max_clientes;
+  return cortes + descansos * cortes_x_descanso;
+}
+
+// Cola para un cliente que llega sin barberos libres: la del barbero que antes
+// acabará; a igualdad, la del que lleva menos clientes desde su descanso
+int Barberia::elegirBarbero() const {
+  int mejor = 0;
+  for (int b = 1; b < num_barberos; b++) {
+    const unsigned fb = finEstimado(b), fm = finEstimado(mejor);
+    if (fb < fm || (fb == fm && clientes_x_barbero[b] < clientes_x_barbero[mejor]))
+      mejor = b;
+  }
+  return mejor;
+}
+
+bool Barberia::siguienteCliente(int i){
+  if (terminado)
+    return false;
+  descansando[i] = false;
+
+  // El cliente que más tiempo lleva esperando en su propia cola o en la de un
+  // barbero que descansa (que tardará en atenderlo) o, si su cola está vacía,
+  // en cualquier otra cola
+  int origen = -1;
+  for (int b = 0; b < num_barberos; b++) {
+    if (cola[b].empty() || (b != i && !descansando[b] && !cola[i].empty()))
+      continue;
+    if (origen == -1 || llegada[cola[b].front()] < llegada[cola[origen].front()])
+      origen = b;
+  }
+
+  if (origen != -1) {
+    const int c = cola[origen].front();
+    cola[origen].pop_front();
+    clientes_esperando--;
+    const int t = tienda;
+    if (origen == i)
+      defer([t, i]{ mensaje() << nombreBarbero(t, i)
+                      << ": Que pase el siguiente cliente!"; });
+    else {
+      robos++;
+      defer([t, i, origen]{ mensaje() << nombreBarbero(t, i)
+                              << ": Que pase el siguiente cliente del " << nombreBarbero(t, origen) << "!"; });
     }
-    mtx.lock();
-    std::cout << std::string( 15, ' ' )
-      << " Cliente" << i
-        << ": Entro a la sala de espera"
-          << endl;                                          //El cliente espera a que el barberlo le de paso                                                            //El cliente notifica que está esperando
-    mtx.unlock();
-    c_clientes.wait();
-  }
-  mtx.lock();
-  std::cout << std::string( 15, ' ' )
-    << " Cliente" << i << ": Pelándose..."
-      << endl;
-  mtx.unlock();
-  c_cliente_pelandose[siguiente_barbero].wait();               //El cliente espera a que el barbero le pele
-  mtx.lock();
-  std::cout << std::string( 15, ' ' )
-    << " Cliente" << i
-      << ": Perfecto! Hasta luego!"
-        << endl;
-  mtx.unlock();
+    cliente_asignado[i] = c;
+    barbero_cliente[c] = i;
+    esperas.record(chrono::duration_cast<chrono::nanoseconds>(VirtualTime::now() - llegada[c]).count());
+    c_turno[c].signal();                                    //El barbero avisa al cliente para que pase
+    return true;
+  }
+
+  barberos_libres.push_back(i);                             //Sin ningun cliente, el barbero se duerme
+  const int t = tienda;
+  defer([t, i]{ mensaje() << nombreBarbero(t, i)
+                  << ": No hay ningun cliente, me duermo zzz..."; });  //Se escribe tras salir del monitor
+  unsigned limpiezas = 0;
+  while (cliente_asignado[i] == -1 && !terminado) {
+    if (!c_barbero[i].wait_for(chrono::milliseconds(intervalo_limpieza))
+        && cliente_asignado[i] == -1 && !terminado) {      //Nadie le ha despertado: limpia y vuelve a dormir
+      limpiezas++;
+    }
+  }
+  if (limpiezas > 0)
+    defer([t, i, limpiezas]{ mensaje() << nombreBarbero(t, i)
+                               << ": No vino nadie, he barrido la barbería " << limpiezas << " veces"; });
+  if (cliente_asignado[i] == -1)                            //Terminado sin cliente
+    return false;
+  defer([t, i]{ mensaje() << nombreBarbero(t, i)
+                  << ": Buenos días zzz... Pase pase"; });
+  return true;
+}
+
+Visita Barberia::cortarPelo(int i) {
+  if (terminado)
+    return visita_cerrada;
+  defer([i]{ mensaje() << std::string( 15, ' ' )
+               << " Cliente" << i
+                 << ": Buenos dias!"; });                    //Se escribe tras salir del monitor
+  if (!barberos_libres.empty()) {                           //Pasa directamente con un barbero libre
+    const int b = barberos_libres.front();
+    barberos_libres.pop_front();
+    cliente_asignado[b] = i;
+    barbero_cliente[i] = b;
+    cambiarOcupacion(+1);
+    esperas.record(0);
+    c_barbero[b].signal();                                  //El cliente despierta al barbero
+  }
+  else {
+    if (clientes_esperando >= unsigned(tamanio_sala))
+      return visita_sala_llena;                             //La recepción le manda a otra barbería
+    const int elegido = elegirBarbero(), t = tienda;
+    defer([i, t, elegido]{ mensaje() << std::string( 15, ' ' )
+                             << " Cliente" << i
+                               << ": Entro a la sala de espera, en la cola del " << nombreBarbero(t, elegido); });
+    cola[elegido].push_back(i);                             //El cliente espera a que un barbero le de paso
+    llegada[i] = VirtualTime::now();
+    cola_cliente[i] = elegido;
+    clientes_esperando++;
+    cambiarOcupacion(+1);
+    const auto limite = llegada[i] + chrono::milliseconds(paciencia_cliente);
+    while (barbero_cliente[i] == -1 && !terminado) {
+      if (!c_turno[i].wait_until(limite) && barbero_cliente[i] == -1 && !terminado) {   //Se acaba la paciencia
+        deque<int> & q = cola[cola_cliente[i]];
+        q.erase(find(q.begin(), q.end(), i));
+        clientes_esperando--;
+        cambiarOcupacion(-1);
+        defer([i]{ mensaje() << std::string( 15, ' ' )
+                     << " Cliente" << i
+                       << ": Llevo mucho esperando, me voy!"; });
+        abandonos++;
+        return visita_abandono;
+      }
+    }
+    if (barbero_cliente[i] == -1)                           //Terminado sin que le atiendan
+      return visita_cerrada;
+  }
+
+  const int b = barbero_cliente[i], t = tienda;
+  barbero_cliente[i] = -1;
+  defer([i, t, b]{ mensaje() << std::string( 15, ' ' )
+                     << " Cliente" << i << ": Pelándose con el " << nombreBarbero(t, b) << "..."; });
+  while (cliente_asignado[b] == i)
+    c_cliente_pelandose[b].wait();                          //El cliente espera a que el barbero le pele
+  defer([i]{ mensaje() << std::string( 15, ' ' )
+               << " Cliente" << i
+                 << ": Perfecto! Hasta luego!"; });
+  return visita_pelado;
 }
 
 bool Barberia::finCliente(int i){
   clientes_x_barbero[i]++;
-  mtx.lock();
-  std::cout << "Barbero"<< i
-    << ": Listo, le gusta como ha quedado?"
-      << endl;
-  mtx.unlock();
-  c_cliente_pelandose[i].signal();                             //El cliente ha sido pelado y sale de la barbería
-
-  if(clientes_x_barbero[i] >= max_clientes){
+  const int t = tienda;
+  defer([t, i]{ mensaje() << nombreBarbero(t, i)
+                  << ": Listo, le gusta como ha quedado?"; });   //Se escribe tras salir del monitor
+  cliente_asignado[i] = -1;
+  cambiarOcupacion(-1);
+
+  const bool descansar = clientes_x_barbero[i] >= unsigned(max_clientes);
+  if(descansar)
     clientes_x_barbero[i] = 0;
-    return true;
+  descansando[i] = descansar && !sinEsperas();
+
+  cortes_barbero[i]++;
+  total_cortes++;
+  if (++cortes_totales == objetivo) {
+    finalizar();                                            //Antes del signal_and_leave, que ha de ser lo último
+    defer([]{ terminarBarberias(); });                      //Las demás, tras salir de esta
   }
-  else
-    return false;
+
+  c_cliente_pelandose[i].signal_and_leave();                   //El cliente ha sido pelado y sale de la barbería
+  return descansar;
+}
+
+// Marca el fin y despierta a todas las hebras bloqueadas en el monitor
+// (el cliente que se está pelando sale cuando su barbero acaba)
+void Barberia::finalizar(){
+  if (terminado)
+    return;
+  terminado = true;
+  fin = VirtualTime::now();
+  cortes_al_fin = total_cortes;
+  for (auto & c : c_turno)
+    c.signal_all();
+  for (auto & c : c_barbero)
+    c.signal_all();
+  c_fin.signal_all();
+}
+
+void Barberia::terminar(){
+  finalizar();
+}
+
+// Espera hasta alcanzar el objetivo o hasta que se agote la duración
+void Barberia::esperarFin(){
+  if (duracion > 0) {
+    const auto limite = inicio + chrono::duration_cast<chrono::steady_clock::duration>(
+                                   chrono::duration<double>(duracion));
+    while (!terminado && c_fin.wait_until(limite))
+      ;
+  }
+  else {
+    while (!terminado)
+      c_fin.wait();
+  }
+  finalizar();
+}
+
+double Barberia::cortesPorSegundo(){
+  return cortes_al_fin / chrono::duration<double>(fin - inicio).count();
+}
+
+// Lo propio de la barbería: los contadores de cada cliente son de la recepción
+void Barberia::informe(){
+  const double segundos = chrono::duration<double>(fin - inicio).count();
+  if (num_barberias > 1)
+    cout << "Barbería " << tienda << ":" << endl;
+  cout << "Tiempo: " << fixed << setprecision(3) << segundos << " s" << endl
+       << "Cortes de pelo: " << total_cortes << " ("
+         << setprecision(1) << cortesPorSegundo() << " por segundo)" << endl
+       << "Clientes que se cansan de esperar: " << abandonos << endl
+       << "Clientes atendidos por otro barbero que el de su cola: " << robos << endl;
+  if (esperas.count > 0)                                    //Los percentiles son cotas superiores (potencias de 2)
+    cout << "Espera en la sala (ms): media " << setprecision(1) << esperas.mean_ns() / 1e6
+         << ", p50 " << esperas.percentile_ns(0.5) / 1e6 << ", p99 " << esperas.percentile_ns(0.99) / 1e6
+         << ", máxima " << esperas.max_ns / 1e6 << endl;
+  for (int i = 0; i < num_barberos; i++)
+    cout << "  " << nombreBarbero(tienda, i) << ": " << cortes_barbero[i] << " cortes" << endl;
+}
+
+//Recepción común de las barberías----------------------------------------------
+// Un monitor por barbería: con muchos barberos y clientes, una sola barbería
+// acaba limitada por su monitor. La recepción no es un monitor: lee la ocupación
+// que publica cada barbería y manda al cliente a la menos ocupada; si tiene la
+// sala llena, a la siguiente, y el cliente solo se va si están todas llenas
+vector<MRef<Barberia>> barberias;
+unique_ptr<atomic<unsigned>[]> ocupacion;                   //Clientes dentro de cada barbería
+vector<unsigned long> cortes_cliente, redirecciones_cliente,  //Contadores de cada cliente (solo los
+                      rechazos_cliente, abandonos_cliente;     //escribe su hebra)
+
+// Despierta a todas las hebras de todas las barberías
+void terminarBarberias(){
+  for (auto & b : barberias)
+    b->terminar();
+}
+
+// Devuelve false cuando las barberías han cerrado
+bool irABarberia(int i){
+  static thread_local vector<pair<unsigned,int>> orden;     //(ocupación, barbería)
+  orden.clear();
+  for (int k = 0; k < num_barberias; k++) {
+    const int t = (i + k) % num_barberias;                  //A igual ocupación, cada cliente empieza por una
+    orden.emplace_back(ocupacion[t].load(memory_order_relaxed), t);
+  }
+  stable_sort(orden.begin(), orden.end(),
+              [](const pair<unsigned,int> & a, const pair<unsigned,int> & b){ return a.first < b.first; });
+
+  for (size_t k = 0; k < orden.size(); k++) {
+    switch (barberias[orden[k].second]->cortarPelo(i)) {
+      case visita_pelado:   cortes_cliente[i]++;    return true;
+      case visita_abandono: abandonos_cliente[i]++; return true;
+      case visita_cerrada:  return false;
+      case visita_sala_llena: break;
+    }
+    if (k+1 < orden.size()) {
+      redirecciones_cliente[i]++;
+      mensaje() << std::string( 15, ' ' )
+        << " Cliente" << i
+          << ": Hay mucha cola, voy a la barbería " << orden[k+1].second;
+    }
+  }
+  rechazos_cliente[i]++;
+  mensaje() << std::string( 15, ' ' )
+    << " Cliente" << i
+      << ": Hay mucha cola, vuelvo luego!";
+  return true;
 }
 
 //Funciones que realizan el trabajo de cliente y barbero------------------------
-void hebra_cliente(MRef<Barberia> barberia, int i){
-  while (true) {
-    barberia->cortarPelo(i);                                //Ir a cortarse el pelo
+void hebra_cliente(int i){
+  ThreadIdentity::current().set_name("Cliente " + to_string(i));
+  while (irABarberia(i)) {                                 //Ir a cortarse el pelo
     esperarFueraBarberia(i);
   }
 }
 
-void hebra_barbero(MRef<Barberia> barberia, int i){
-  while (true) {
-    barberia->siguienteCliente(i);
-    cortarPeloACliente(i);
-    if(barberia->finCliente(i)){
-      mtx.lock();
-      std::cout << "Barbero" << i
-        << ": Estoy muy cansado, voy a descansar un ratito"
-          << endl;
-      mtx.unlock();
-      this_thread::sleep_for(std::chrono::seconds(2));
+void hebra_barbero(MRef<Barberia> barberia, int tienda, int i){
+  if (num_barberias > 1)
+    ThreadIdentity::current().set_name("Barbero " + to_string(tienda) + "." + to_string(i));
+  else
+    ThreadIdentity::current().set_name("Barbero " + to_string(i));
+  while (barberia->siguienteCliente(i)) {
+    cortarPeloACliente(tienda, i);
+    // finCliente no espera: llamada combinada (ver MRef::combine)
+    const bool descansar = barberia.combine([i](Barberia & b){ return b.finCliente(i); });
+    if(descansar && !sinEsperas()){
+      mensaje() << nombreBarbero(tienda, i)
+        << ": Estoy muy cansado, voy a descansar un ratito";
+      VirtualTime::sleep_for(std::chrono::seconds(2));
 
-      mtx.lock();
-      std::cout << "Barbero" << i
-        << ": Ya he descansado, a trabajar!"
-          << endl;
+      mensaje() << nombreBarbero(tienda, i)
+        << ": Ya he descansado, a trabajar!";
     }
   }
 }
 
+//Opciones de la línea de órdenes-----------------------------------------------
+void uso(const char * prog) {
+  cerr << "uso: " << prog << " [-c clientes] [-b barberos] [-t barberias] [-m max_clientes] [-s tamanio_sala]" << endl
+       << "          [-p paciencia_ms] [-l limpieza_ms] [-d segundos] [-n cortes] [-q] [-v] [-r semilla] [-e]" << endl
+       << "   -t    : barberías (cada una con -b barberos y una sala de -s clientes) y una recepción común" << endl
+       << "   -d, -n: terminar tras ese tiempo o ese número de cortes de pelo, e informar" << endl
+       << "   -q    : modo de carga, sin esperas ni mensajes (5 segundos si no hay -d ni -n)" << endl
+       << "   -v    : tiempo virtual: las esperas no duran nada, y con -r la ejecución se repite" << endl
+       << "   -e    : escribir las estadísticas del monitor al terminar" << endl;
+  exit(1);
+}
+
+void leerOpciones(int argc, char const *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const string opt = argv[i];
+    if (opt == "-q")
+      sin_salida = true;
+    else if (opt == "-v")
+      tiempo_virtual = true;
+    else if (opt == "-e")
+      estadisticas = true;
+    else {
+      if (i+1 >= argc)
+        uso(argv[0]);
+      const char * val = argv[++i];
+      if (opt == "-c")
+        num_clientes = atoi(val);
+      else if (opt == "-b")
+        num_barberos = atoi(val);
+      else if (opt == "-t")
+        num_barberias = atoi(val);
+      else if (opt == "-m")
+        max_clientes = atoi(val);
+      else if (opt == "-s")
+        tamanio_sala = atoi(val);
+      else if (opt == "-p")
+        paciencia_cliente = atoi(val);
+      else if (opt == "-l")
+        intervalo_limpieza = atoi(val);
+      else if (opt == "-d")
+        duracion = atof(val);
+      else if (opt == "-r")
+        semilla = atol(val);
+      else if (opt == "-n")
+        objetivo = strtoul(val, nullptr, 10);
+      else
+        uso(argv[0]);
+    }
+  }
+  if (num_clientes < 1 || num_barberos < 1 || num_barberias < 1 || max_clientes < 1 || tamanio_sala < 0
+      || paciencia_cliente < 0 || intervalo_limpieza < 1 || duracion < 0)
+    uso(argv[0]);
+  if (sin_salida && duracion == 0 && objetivo == 0)
+    duracion = 5;
+}
+
 //Función principal-------------------------------------------------------------
 int main(int argc, char const *argv[]) {
-  mtx.lock();
-  cout << "------------------------" << endl
+  leerOpciones(argc, argv);
+  const auto inicio_real = chrono::steady_clock::now();
+  if (tiempo_virtual)
+    VirtualTime::start();                                   //Antes de crear el monitor y las hebras
+
+  mensaje() << "------------------------" << endl
        << "Problema de la barberia." << endl
-       << "------------------------" << endl;
-  mtx.unlock();
-  auto barberia = Create<Barberia>();
+       << "------------------------";
+  ocupacion.reset(new atomic<unsigned>[num_barberias]);
+  for (int t = 0; t < num_barberias; t++) {
+    ocupacion[t] = 0;
+    barberias.push_back(Create<Barberia>(t, &ocupacion[t]));
+    barberias[t]->set_stats_enabled(estadisticas);
+  }
+  cortes_cliente.assign(num_clientes, 0);
+  redirecciones_cliente.assign(num_clientes, 0);
+  rechazos_cliente.assign(num_clientes, 0);
+  abandonos_cliente.assign(num_clientes, 0);
 
-  thread barberos[num_barberos];
-  thread clientes[num_clientes];
-  for (size_t i = 0; i < num_barberos; i++) {
-    barberos[i] = thread(hebra_barbero, barberia, i);
+  vector<thread> barberos, clientes;
+  for (int t = 0; t < num_barberias; t++) {
+    for (int i = 0; i < num_barberos; i++) {
+      barberos.push_back(VirtualTime::spawn(hebra_barbero, barberias[t], t, i));
+    }
   }
-  for (size_t i = 0; i < num_clientes; i++) {
-    clientes[i] = thread(hebra_cliente, barberia, i);
+  for (int i = 0; i < num_clientes; i++) {
+    clientes.push_back(VirtualTime::spawn(hebra_cliente, i));
   }
 
-  for (size_t i = 0; i < num_barberos; i++) {
-    barberos[i].join();
+  if (duracion > 0 || objetivo > 0) {                       //Sin límites el programa no termina nunca
+    barberias[0]->esperarFin();                             //Las demás terminan a la vez que la primera
+    terminarBarberias();
+  }
+  VirtualTime::leave();                                     //Con tiempo virtual, las demás hebras siguen sin esta
+
+  for (auto & b : barberos) {
+    b.join();
+  }
+  for (auto & c : clientes) {
+    c.join();
+  }
+
+  const double segundos_reales = chrono::duration<double>(chrono::steady_clock::now() - inicio_real).count();
+  AsyncLog::instance().flush();                             //Los mensajes pendientes, antes del informe
+  double cortes_x_segundo = 0;
+  for (auto & b : barberias) {
+    b->informe();
+    cortes_x_segundo += b->cortesPorSegundo();
+  }
+  unsigned long cortes = 0, redirecciones = 0, rechazos = 0;
+  for (int i = 0; i < num_clientes; i++) {
+    cortes += cortes_cliente[i];
+    redirecciones += redirecciones_cliente[i];
+    rechazos += rechazos_cliente[i];
   }
-  for (size_t i = 0; i < num_clientes; i++) {
-    clientes[i].join();
+  if (num_barberias > 1)
+    cout << "Barberías: " << num_barberias << ", cortes de pelo: " << cortes << " ("
+           << setprecision(1) << cortes_x_segundo << " por segundo en total)" << endl
+         << "Clientes enviados a otra barbería (sala llena): " << redirecciones << endl;
+  cout << "Clientes rechazados (" << (num_barberias > 1 ? "todas las salas llenas" : "sala llena") << "): "
+       << rechazos << endl;
+  for (int i = 0; i < num_clientes; i++) {
+    cout << "  Cliente" << i << ": " << cortes_cliente[i] << " cortes, ";
+    if (num_barberias > 1)
+      cout << redirecciones_cliente[i] << " cambios de barbería, ";
+    cout << rechazos_cliente[i] << " rechazos, " << abandonos_cliente[i] << " abandonos" << endl;
   }
+  if (tiempo_virtual)
+    cout << "Tiempo real: " << fixed << setprecision(3) << segundos_reales << " s" << endl;
+  if (estadisticas)
+    for (auto & b : barberias)
+      b->print_stats(cout);
   return 0;
 }
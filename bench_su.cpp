@@ -0,0 +1,608 @@
+// *****************************************************************************
+//
+// Microbenchmarks for the HoareMonitor primitives
+//
+// Measured operations:
+//   enter     : uncontended enter()/leave() pair through Call_proxy (1 thread)
+//   contended : enter()/leave() pairs with N threads on the same monitor
+//   combined  : as contended, calling through MRef::combine (flat combining)
+//   mixed     : half the threads put items with plain calls and take them with
+//               MRef::combine, the other half the other way round; the takes
+//               wait while there are no items, so some combined calls are given
+//               back to their threads. The final count is checked at the end.
+//   async     : as contended, queuing the calls with MRef::async: the latency
+//               is the time the producer spends queuing each one (at most 64
+//               pending per thread, then it waits for the oldest)
+//   pingpong  : CondVar signal() -> wait() round trips, N/2 pairs of threads
+//   handoff   : as pingpong, using signal_and_leave() instead of signal()
+//   sharing   : as contended, each call writing the user state of the monitor
+//               (compare with a build with -DCOMPACTO_M to see false sharing)
+//   nwt       : CondVar::get_nwt() called from inside the monitor
+//   name      : get_thread_name() called from inside the monitor (each
+//               thread registers its name first)
+//
+// Every benchmark runs on Hoare monitors ("urgent wait") and/or Mesa
+// monitors ("signal and continue"), with the monitor statistics disabled
+// and/or enabled (to measure their cost).
+//
+// Output is CSV (one line per benchmark, monitor type and thread count), with
+// throughput (operations per second), latency percentiles in nanoseconds and,
+// if the hardware counters are available (perf_event_open), the L1 data cache
+// read misses and last level cache misses per operation (empty if not).
+//
+// usage: bench_su [-n ops_per_thread] [-t threads_list] [-b benchmarks_list]
+//                 [-s spin_limits_list] [-m monitors_list] [-e stats_list]
+//   example: bench_su -n 20000 -t 1,2,4,8 -b contended,pingpong -s 0,200 -m hoare,mesa -e 0,1
+//
+// *****************************************************************************
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>               // memset
+#ifdef __linux__
+#include <unistd.h>              // syscall, read, close
+#include <sys/syscall.h>         // SYS_perf_event_open
+#include <linux/perf_event.h>    // perf_event_attr
+#endif
+#include "HoareMonitor.hpp"
+
+using namespace HM ;
+using namespace std ;
+
+typedef chrono::steady_clock reloj ;
+
+// *****************************************************************************
+// latencies recorder (one per thread, no sharing)
+
+class Recorder
+{
+   public:
+   vector<uint64_t> samples ; // latencies in nanoseconds
+
+   explicit Recorder( size_t capacity ) { samples.reserve( capacity ); }
+
+   inline void add( reloj::time_point t0, reloj::time_point t1 )
+   {
+      samples.push_back( uint64_t(
+         chrono::duration_cast<chrono::nanoseconds>( t1-t0 ).count() ) );
+   }
+} ;
+
+// *****************************************************************************
+// hardware cache counters of this process, including the threads created
+// after opening them (their counts are added when they end)
+
+class Contadores
+{
+   public:
+   Contadores() ;
+   ~Contadores() ;
+
+   bool     disponibles() const { return fd_l1d >= 0 && fd_llc >= 0 ; }
+   uint64_t fallos_l1d() const { return leer( fd_l1d ); }
+   uint64_t fallos_llc() const { return leer( fd_llc ); }
+
+   private:
+   int fd_l1d, fd_llc ;
+
+   static int      abrir( bool l1d );   // (false: last level cache)
+   static uint64_t leer( int fd );
+} ;
+// -----------------------------------------------------------------------------
+
+Contadores::Contadores()
+:  fd_l1d( abrir( true ) ),
+   fd_llc( abrir( false ) )
+{
+}
+// -----------------------------------------------------------------------------
+
+Contadores::~Contadores()
+{
+   if ( fd_l1d >= 0 )
+      close( fd_l1d );
+   if ( fd_llc >= 0 )
+      close( fd_llc );
+}
+// -----------------------------------------------------------------------------
+// (-1 if not available: no hardware counters, as in most virtual machines,
+// or not allowed by /proc/sys/kernel/perf_event_paranoid)
+
+int Contadores::abrir( bool l1d )
+{
+#ifdef __linux__
+   perf_event_attr attr ;
+   memset( &attr, 0, sizeof(attr) );
+   attr.size           = sizeof(attr);
+   attr.type           = l1d ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE ;
+   attr.config         = l1d ? ( PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 )
+                                 | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) )
+                             : PERF_COUNT_HW_CACHE_MISSES ;
+   attr.inherit        = 1 ;
+   attr.exclude_kernel = 1 ;
+   attr.exclude_hv     = 1 ;
+   return int( syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 ) );
+#else
+   (void) l1d ;
+   return -1 ;
+#endif
+}
+// -----------------------------------------------------------------------------
+
+uint64_t Contadores::leer( int fd )
+{
+   uint64_t valor = 0 ;
+   if ( fd < 0 || ::read( fd, &valor, sizeof(valor) ) != ssize_t( sizeof(valor) ) )
+      return 0 ;
+   return valor ;
+}
+
+// *****************************************************************************
+// monitor used by all the benchmarks (Base is HoareMonitor or MesaMonitor)
+
+template<class Base> class BenchMonitor : public Base
+{
+   private:
+   typedef typename Base::CondVar CondVar ;
+
+   unsigned long   hits ;    // user state written by 'touch'
+   unsigned        last ;
+   vector<int>     turn ;    // for each ping-pong pair: 0 -> ping, 1 -> pong
+   vector<CondVar> c_ping,   // ping thread of each pair waits here
+                   c_pong ;  // pong thread of each pair waits here
+   CondVar         c_empty ; // never used to wait, only queried
+   unsigned long   items,    // 'mixed' benchmark: items put and not yet taken
+                   puts,     //    items put
+                   takes ;   //    items taken
+   CondVar         c_items ; //    'take' waits here while there are no items
+
+   public:
+   BenchMonitor( unsigned num_pairs ) ;
+
+   void nop() {}
+   void touch( unsigned i ) { hits++ ; last = i ; }
+   void ping( unsigned p, bool and_leave ) ;
+   void pong( unsigned p, bool and_leave ) ;
+   void probe_nwt( unsigned k, Recorder & rec ) ;
+   void probe_name( unsigned k, Recorder & rec ) ;
+   void put() ;
+   void take() ;
+   bool check( unsigned long total ) { return items == 0 && puts == total && takes == total ; }
+} ;
+// -----------------------------------------------------------------------------
+
+template<class Base> BenchMonitor<Base>::BenchMonitor( unsigned num_pairs )
+:  Base( "bench" ),
+   hits( 0 ),
+   last( 0 ),
+   items( 0 ),
+   puts( 0 ),
+   takes( 0 )
+{
+   for( unsigned p = 0 ; p < num_pairs ; p++ )
+   {
+      turn.push_back( 0 );
+      c_ping.push_back( this->newCondVar() );
+      c_pong.push_back( this->newCondVar() );
+   }
+   c_empty = this->newCondVar();
+   c_items = this->newCondVar();
+}
+// -----------------------------------------------------------------------------
+
+template<class Base> void BenchMonitor<Base>::ping( unsigned p, bool and_leave )
+{
+   while ( turn[p] != 0 )
+      c_ping[p].wait();
+   turn[p] = 1 ;
+   if ( and_leave )
+      c_pong[p].signal_and_leave();
+   else
+      c_pong[p].signal();
+}
+// -----------------------------------------------------------------------------
+
+template<class Base> void BenchMonitor<Base>::pong( unsigned p, bool and_leave )
+{
+   while ( turn[p] != 1 )
+      c_pong[p].wait();
+   turn[p] = 0 ;
+   if ( and_leave )
+      c_ping[p].signal_and_leave();
+   else
+      c_ping[p].signal();
+}
+// -----------------------------------------------------------------------------
+
+template<class Base> void BenchMonitor<Base>::probe_nwt( unsigned k, Recorder & rec )
+{
+   unsigned total = 0 ;
+   for( unsigned i = 0 ; i < k ; i++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      total += c_empty.get_nwt();
+      rec.add( t0, reloj::now() );
+   }
+   assert( total == 0 );
+}
+
+// -----------------------------------------------------------------------------
+
+template<class Base> void BenchMonitor<Base>::probe_name( unsigned k, Recorder & rec )
+{
+   size_t total = 0 ;
+   for( unsigned i = 0 ; i < k ; i++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      total += this->get_thread_name().size();
+      rec.add( t0, reloj::now() );
+   }
+   assert( total > 0 );
+}
+
+// -----------------------------------------------------------------------------
+
+template<class Base> void BenchMonitor<Base>::put()
+{
+   items++ ;
+   puts++ ;
+   c_items.signal();
+}
+// -----------------------------------------------------------------------------
+
+template<class Base> void BenchMonitor<Base>::take()
+{
+   while ( items == 0 )
+      c_items.wait();
+   items-- ;
+   takes++ ;
+}
+
+// *****************************************************************************
+// threads bodies
+
+template<class M> void hebra_enter( MRef<M> mon, unsigned n, Recorder * rec )
+{
+   for( unsigned i = 0 ; i < n ; i++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      mon->nop();
+      rec->add( t0, reloj::now() );
+   }
+}
+// -----------------------------------------------------------------------------
+
+template<class M> void hebra_sharing( MRef<M> mon, unsigned i, unsigned n, Recorder * rec )
+{
+   for( unsigned j = 0 ; j < n ; j++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      mon->touch( i );
+      rec->add( t0, reloj::now() );
+   }
+}
+// -----------------------------------------------------------------------------
+
+template<class M> void hebra_combined( MRef<M> mon, unsigned n, Recorder * rec )
+{
+   for( unsigned i = 0 ; i < n ; i++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      mon.combine( []( M & m ) { m.nop(); } );
+      rec->add( t0, reloj::now() );
+   }
+}
+// -----------------------------------------------------------------------------
+
+// each iteration puts an item and then takes one, so there is always an item
+// for every thread waiting in 'take'
+
+template<class M> void hebra_mixed( MRef<M> mon, unsigned i, unsigned n, Recorder * rec )
+{
+   for( unsigned j = 0 ; j < n ; j++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      if ( i % 2 == 0 )
+      {
+         mon->put();
+         mon.combine( []( M & m ) { m.take(); } );
+      }
+      else
+      {
+         mon.combine( []( M & m ) { m.put(); } );
+         mon->take();
+      }
+      rec->add( t0, reloj::now() );
+   }
+}
+// -----------------------------------------------------------------------------
+
+// maximum number of pending asynchronous calls per thread
+static const unsigned max_async_pending = 64 ;
+
+template<class M> void hebra_async( MRef<M> mon, unsigned n, Recorder * rec )
+{
+   deque< MonitorFuture<void> > pendientes ;
+   for( unsigned i = 0 ; i < n ; i++ )
+   {
+      if ( pendientes.size() == max_async_pending )
+      {
+         pendientes.front().wait();
+         pendientes.pop_front();
+      }
+      const reloj::time_point t0 = reloj::now();
+      pendientes.push_back( mon.async( []( M & m ) { m.nop(); } ) );
+      rec->add( t0, reloj::now() );
+   }
+   for( auto & f : pendientes )
+      f.wait();
+}
+// -----------------------------------------------------------------------------
+
+template<class M> void hebra_ping( MRef<M> mon, unsigned p, bool sl, unsigned n, Recorder * rec )
+{
+   for( unsigned i = 0 ; i < n ; i++ )
+   {
+      const reloj::time_point t0 = reloj::now();
+      mon->ping( p, sl );
+      rec->add( t0, reloj::now() );
+   }
+}
+// -----------------------------------------------------------------------------
+
+template<class M> void hebra_pong( MRef<M> mon, unsigned p, bool sl, unsigned n )
+{
+   for( unsigned i = 0 ; i < n ; i++ )
+      mon->pong( p, sl );
+}
+// -----------------------------------------------------------------------------
+
+template<class M> void hebra_nwt( MRef<M> mon, unsigned n, Recorder * rec )
+{
+   const unsigned lote = 64 ;
+   for( unsigned i = 0 ; i < n ; i += lote )
+      mon->probe_nwt( std::min( lote, n-i ), *rec );
+}
+
+// -----------------------------------------------------------------------------
+
+template<class M> void hebra_name( MRef<M> mon, unsigned i, unsigned n, Recorder * rec )
+{
+   const unsigned lote = 64 ;
+   ThreadIdentity::current().set_name( "bench " + to_string( i ) );
+   for( unsigned j = 0 ; j < n ; j += lote )
+      mon->probe_name( std::min( lote, n-j ), *rec );
+}
+
+// *****************************************************************************
+// run a benchmark and print its results line
+
+struct Resultado
+{
+   unsigned spin ;    // spin limit used by the monitor
+   bool     stats ;   // statistics enabled in the monitor
+   uint64_t ops ;
+   double   seconds ;
+   uint64_t p50, p99, p999 ;
+   bool     perf ;             // hardware counters available
+   uint64_t l1d, llc ;         // cache misses in the run
+} ;
+// -----------------------------------------------------------------------------
+
+uint64_t percentil( const vector<uint64_t> & sorted, double q )
+{
+   if ( sorted.empty() )
+      return 0 ;
+   size_t pos = size_t( q*double(sorted.size()) );
+   return sorted[ std::min( pos, sorted.size()-1 ) ];
+}
+// -----------------------------------------------------------------------------
+
+template<class Base>
+Resultado ejecutar( const string & bench, unsigned num_threads, unsigned n, int spin, bool stats )
+{
+   typedef BenchMonitor<Base> M ;
+
+   const bool     sl        = ( bench == "handoff" ),
+                  pp        = ( bench == "pingpong" || sl );
+   const unsigned num_pairs = pp ? std::max( 1u, num_threads/2 ) : 0 ;
+   const unsigned num_rec   = pp ? num_pairs : num_threads ;
+
+   MRef<M> mon = Create<M>( num_pairs );
+   if ( 0 <= spin )
+      mon->set_spin_limit( unsigned( spin ) );
+   mon->set_stats_enabled( stats );
+   vector<Recorder *> recs ;
+   vector<thread>     hebras ;
+
+   for( unsigned i = 0 ; i < num_rec ; i++ )
+      recs.push_back( new Recorder( n ) );
+
+   const Contadores        contadores ;
+   const reloj::time_point inicio = reloj::now();
+
+   if ( pp )
+      for( unsigned p = 0 ; p < num_pairs ; p++ )
+      {
+         hebras.push_back( thread( hebra_ping<M>, mon, p, sl, n, recs[p] ) );
+         hebras.push_back( thread( hebra_pong<M>, mon, p, sl, n ) );
+      }
+   else
+      for( unsigned i = 0 ; i < num_threads ; i++ )
+      {
+         if ( bench == "nwt" )
+            hebras.push_back( thread( hebra_nwt<M>, mon, n, recs[i] ) );
+         else if ( bench == "name" )
+            hebras.push_back( thread( hebra_name<M>, mon, i, n, recs[i] ) );
+         else if ( bench == "combined" )
+            hebras.push_back( thread( hebra_combined<M>, mon, n, recs[i] ) );
+         else if ( bench == "mixed" )
+            hebras.push_back( thread( hebra_mixed<M>, mon, i, n, recs[i] ) );
+         else if ( bench == "sharing" )
+            hebras.push_back( thread( hebra_sharing<M>, mon, i, n, recs[i] ) );
+         else if ( bench == "async" )
+            hebras.push_back( thread( hebra_async<M>, mon, n, recs[i] ) );
+         else
+            hebras.push_back( thread( hebra_enter<M>, mon, n, recs[i] ) );
+      }
+
+   for( auto & h : hebras )
+      h.join();
+
+   const reloj::time_point fin = reloj::now();
+
+   if ( bench == "mixed" && ! mon->check( (unsigned long)num_threads*n ) )
+   {
+      cerr << "error: cuenta final incorrecta en el benchmark 'mixed'" << endl ;
+      exit( 2 );
+   }
+   const uint64_t          l1d = contadores.fallos_l1d(),
+                           llc = contadores.fallos_llc();
+
+   vector<uint64_t> todas ;
+   for( auto r : recs )
+   {
+      todas.insert( todas.end(), r->samples.begin(), r->samples.end() );
+      delete r ;
+   }
+   std::sort( todas.begin(), todas.end() );
+
+   Resultado res ;
+   res.spin    = mon->get_spin_limit();
+   res.stats   = mon->get_stats_enabled();
+   res.ops     = todas.size();
+   res.seconds = chrono::duration<double>( fin-inicio ).count();
+   res.p50     = percentil( todas, 0.50 );
+   res.p99     = percentil( todas, 0.99 );
+   res.p999    = percentil( todas, 0.999 );
+   res.perf    = contadores.disponibles();
+   res.l1d     = l1d ;
+   res.llc     = llc ;
+   return res ;
+}
+
+// *****************************************************************************
+// command line parsing
+
+vector<string> separar( const string & s )
+{
+   vector<string> partes ;
+   size_t ini = 0 ;
+   while ( ini <= s.size() )
+   {
+      size_t fin = s.find( ',', ini );
+      if ( fin == string::npos )
+         fin = s.size();
+      if ( fin > ini )
+         partes.push_back( s.substr( ini, fin-ini ) );
+      ini = fin+1 ;
+   }
+   return partes ;
+}
+// -----------------------------------------------------------------------------
+
+void uso( const char * prog )
+{
+   cerr << "uso: " << prog
+        << " [-n ops_por_hebra] [-t lista_hebras] [-b lista_benchmarks]"
+        << " [-s lista_limites_espera_activa] [-m lista_monitores]"
+        << " [-e lista_estadisticas]" << endl
+        << "   benchmarks: enter, contended, combined, mixed, async, sharing, pingpong, handoff, nwt, name" << endl
+        << "   monitores : hoare, mesa" << endl
+        << "   estadisticas: 0 (desactivadas), 1 (activadas)" << endl ;
+   exit( 1 );
+}
+
+// *****************************************************************************
+
+int main( int argc, char * argv[] )
+{
+   unsigned         n        = 20000 ;
+   vector<unsigned> threads  = { 1, 2, 4, 8, 16 } ;
+   vector<string>   benches  = { "enter", "contended", "combined", "mixed", "async", "sharing", "pingpong", "handoff", "nwt", "name" } ;
+   vector<int>      spins    = { -1 } ;  // -1: monitor default spin limit
+   vector<string>   monitors = { "hoare", "mesa" } ;
+   vector<int>      stats    = { 0 } ;
+
+   for( int i = 1 ; i < argc ; i++ )
+   {
+      const string opt = argv[i] ;
+      if ( i+1 >= argc )
+         uso( argv[0] );
+      const string val = argv[++i] ;
+      if ( opt == "-n" )
+         n = unsigned( atoi( val.c_str() ) );
+      else if ( opt == "-t" )
+      {
+         threads.clear();
+         for( auto & s : separar( val ) )
+            threads.push_back( unsigned( atoi( s.c_str() ) ) );
+      }
+      else if ( opt == "-b" )
+         benches = separar( val );
+      else if ( opt == "-m" )
+         monitors = separar( val );
+      else if ( opt == "-s" )
+      {
+         spins.clear();
+         for( auto & v : separar( val ) )
+            spins.push_back( atoi( v.c_str() ) );
+      }
+      else if ( opt == "-e" )
+      {
+         stats.clear();
+         for( auto & v : separar( val ) )
+            stats.push_back( atoi( v.c_str() ) );
+      }
+      else
+         uso( argv[0] );
+   }
+   if ( n == 0 || threads.empty() || spins.empty() || monitors.empty() || stats.empty() )
+      uso( argv[0] );
+
+   for( auto & m : monitors )
+      if ( m != "hoare" && m != "mesa" )
+         uso( argv[0] );
+
+   if ( ! Contadores().disponibles() )
+      cerr << "(sin contadores hardware de caché: las dos últimas columnas quedan vacías)" << endl ;
+
+   cout << "benchmark,monitor,threads,spin,stats,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,l1d_misses_per_op,llc_misses_per_op" << endl ;
+
+   for( auto & b : benches )
+   {
+      if ( b != "enter" && b != "contended" && b != "combined" && b != "mixed" && b != "async" && b != "sharing" && b != "pingpong" && b != "handoff"
+           && b != "nwt" && b != "name" )
+         uso( argv[0] );
+
+      // the uncontended benchmark always runs with a single thread
+      const vector<unsigned> lista = ( b == "enter" ) ? vector<unsigned>{ 1 } : threads ;
+
+      for( auto & m : monitors )
+      for( int s : spins )
+      for( int e : stats )
+      for( unsigned t : lista )
+      {
+         if ( t == 0 || ( ( b == "pingpong" || b == "handoff" ) && t < 2 ) )
+            continue ;
+         const Resultado r = ( m == "hoare" ) ? ejecutar<HoareMonitor>( b, t, n, s, e != 0 )
+                                              : ejecutar<MesaMonitor>( b, t, n, s, e != 0 );
+         cout << b << "," << m << "," << t << "," << r.spin << "," << r.stats << "," << r.ops << "," << r.seconds << ","
+              << uint64_t( double(r.ops)/r.seconds ) << ","
+              << r.p50 << "," << r.p99 << "," << r.p999 << "," ;
+         if ( r.perf )
+            cout << double(r.l1d)/double(r.ops) << "," << double(r.llc)/double(r.ops) ;
+         else
+            cout << "," ;
+         cout << endl ;
+      }
+   }
+   return 0 ;
+}
@@ -0,0 +1,297 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/resource.h>   // getrusage
+#include "CoMonitor.hpp"
+#include "AsyncLog.hpp"
+
+using namespace HM;
+using namespace std;
+
+// Fumadores con corrutinas (C++20): el estanquero y cada fumador son
+// corrutinas, y un conjunto fijo de hebras las ejecuta (ver CoMonitor.hpp).
+// El monitor tiene semántica Hoare, como fumadores_su.
+
+//Variables globales (configurables desde la línea de órdenes, ver 'uso')------
+int
+  num_fumadores = 3;           // número de fumadores
+unsigned
+  num_hebras = 0;              // hebras que ejecutan las corrutinas (0: una por procesador)
+double
+  duracion = 0;                // segundos hasta terminar (0: sin límite)
+unsigned long
+  objetivo = 0;                // cigarros fumados hasta terminar (0: sin límite)
+bool
+  sin_salida = false;          // modo de carga: sin esperas ni mensajes
+
+//Mensajes del programa (ninguno en el modo de carga: una línea nula)-----------
+inline LogLine mensaje(){
+  return async_log(!sin_salida);
+}
+
+//Generador de números aleatorios (uno por hebra)-------------------------------
+int aleatorio(int min, int max){
+  static thread_local default_random_engine generador( (random_device())() );
+  return uniform_int_distribution<int>( min, max )( generador );
+}
+
+//Produce un ingrediente entre 0 y (num_fumadores-1)----------------------------
+int producirIngrediente(){
+  int igr = aleatorio(0, num_fumadores-1);
+  return igr;
+}
+
+// En el modo de carga el fumador solo cede su hebra a las demás corrutinas
+CoTask<> fumar(int num_fumador){
+  if (sin_salida) {
+    co_await CoPool::sleep_for(chrono::milliseconds(0));
+    co_return;
+  }
+
+  // calcular milisegundos aleatorios de duración de la acción de fumar)
+  chrono::milliseconds duracion_fumar( aleatorio(20, 200) );
+
+  // informa de que comienza a fumar
+  mensaje() << "Fumador" << num_fumador << ":"
+        << " empieza a fumar (" << duracion_fumar.count()
+          << " milisegundos)";
+
+  // espera (sin bloquear la hebra) un tiempo igual a 'duracion_fumar' milisegundos
+  co_await CoPool::sleep_for( duracion_fumar );
+
+  // informa de que ha terminado de fumar
+  mensaje() << "Fumador" << num_fumador
+          << ": termina de fumar, comienza espera de ingrediente.";
+}
+
+//Monitor para regular la interaccion estanquero-fumador------------------------
+// Los procedimientos son corrutinas: entran con 'co_await enter()' y salen al
+// terminar (al destruirse 'dentro')
+class Estanco : public CoMonitor{
+private:
+  int mostrador;                          //Mostrador vacio: -1; con ing_i = i
+  CoCondVar c_est, c_fin;
+  vector<CoCondVar> c_fum;
+
+  bool terminado;                         //Fin de la ejecución: las corrutinas salen de sus bucles
+  unsigned long total_cigarros;
+  unsigned long ingredientes_puestos;
+  vector<unsigned long> cigarros;         //Cigarros de cada fumador
+  chrono::steady_clock::time_point inicio, fin;
+
+  CoTask<> finalizar();
+
+public:
+  Estanco ();
+  CoTask<> ponerIngrediente(int i);
+  CoTask<bool> esperarMostradorVacio();
+  CoTask<bool> obtenerIngrediente(int i);
+
+  CoTask<> esperarFin();
+  void informe();
+};
+
+//Implementación de los métodos del monitor-------------------------------------
+
+// Constructor
+Estanco::Estanco()
+: CoMonitor("estanco") {
+  mostrador = -1;
+  c_est  = newCondVar();
+  for (int i = 0; i < num_fumadores; i++) {
+    c_fum.push_back(newCondVar());
+  }
+  c_fin  = newCondVar();
+
+  terminado = false;
+  total_cigarros = 0;
+  ingredientes_puestos = 0;
+  cigarros.assign(num_fumadores, 0);
+  inicio = chrono::steady_clock::now();
+}
+
+CoTask<> Estanco::ponerIngrediente(int i){
+  auto dentro = co_await enter();
+  mostrador = i;
+  ingredientes_puestos++;
+
+  mensaje() << "Ingrediente en venta: " << i;
+
+  c_fum[i].signal_and_leave(dentro);      //Última operación: no hace falta esperar en la cola urgente
+}
+
+CoTask<bool> Estanco::esperarMostradorVacio(){
+  auto dentro = co_await enter();
+  while (mostrador != -1 && !terminado) {
+    co_await c_est.wait();
+  }
+  co_return !terminado;
+}
+
+CoTask<bool> Estanco::obtenerIngrediente(int i){
+  auto dentro = co_await enter();
+  while (mostrador != i && !terminado) {
+    co_await c_fum[i].wait();
+  }
+  if (terminado)
+    co_return false;
+  mensaje() << "Retirado ingrediente " << i;
+
+  mostrador = -1;
+  cigarros[i]++;
+  if (++total_cigarros == objetivo)
+    co_await finalizar();                 //Antes del signal_and_leave, que ha de ser lo último
+
+  c_est.signal_and_leave(dentro);
+  co_return true;
+}
+
+// Marca el fin y despierta a todas las corrutinas bloqueadas en el monitor
+CoTask<> Estanco::finalizar(){
+  if (terminado)
+    co_return;
+  terminado = true;
+  fin = chrono::steady_clock::now();
+  co_await c_est.signal_all();
+  for (auto & c : c_fum)
+    co_await c.signal_all();
+  co_await c_fin.signal_all();
+}
+
+// Espera hasta alcanzar el objetivo o hasta que se agote la duración
+CoTask<> Estanco::esperarFin(){
+  auto dentro = co_await enter();
+  if (duracion > 0) {
+    const auto limite = inicio + chrono::duration_cast<chrono::steady_clock::duration>(
+                                   chrono::duration<double>(duracion));
+    while (!terminado) {
+      const bool avisado = co_await c_fin.wait_until(limite);
+      if (!avisado)                       //Se acaba el tiempo
+        break;
+    }
+  }
+  else {
+    while (!terminado)
+      co_await c_fin.wait();
+  }
+  co_await finalizar();
+}
+
+// (al final, sin corrutinas en ejecución)
+void Estanco::informe(){
+  const double segundos = chrono::duration<double>(fin - inicio).count();
+  cout << "Tiempo: " << fixed << setprecision(3) << segundos << " s" << endl
+       << "Cigarros: " << total_cigarros << " ("
+         << setprecision(1) << total_cigarros / segundos << " por segundo)" << endl
+       << "Ingredientes puestos por el estanquero: " << ingredientes_puestos << endl
+       << "Traspasos del monitor: " << get_handoffs() << " ("
+         << get_handoffs() / segundos << " por segundo)" << endl;
+  if (num_fumadores <= 20) {
+    for (int i = 0; i < num_fumadores; i++)
+      cout << "  Fumador" << i << ": " << cigarros[i] << " cigarros" << endl;
+  }
+  else {                                  //Demasiados para listarlos
+    const auto mm = minmax_element(cigarros.begin(), cigarros.end());
+    cout << "  Cigarros por fumador: entre " << *mm.first << " y " << *mm.second << endl;
+  }
+}
+
+//Corrutinas de estanquero y fumadores------------------------------------------
+// (g++ 12: el resultado de co_await, en una variable antes de usarlo en una condición)
+
+CoTask<> estanquero(Estanco & estanco) {
+  for (;;) {
+    const int ing = producirIngrediente();
+    const bool seguir = co_await estanco.esperarMostradorVacio();
+    if (!seguir)
+      break;
+    co_await estanco.ponerIngrediente(ing);
+  }
+}
+
+CoTask<> fumador(Estanco & estanco, int i) {
+  for (;;) {
+    const bool seguir = co_await estanco.obtenerIngrediente(i);
+    if (!seguir)
+      break;
+    co_await fumar(i);
+  }
+}
+
+CoTask<> cronometro(Estanco & estanco){
+  co_await estanco.esperarFin();
+}
+
+//Opciones de la línea de órdenes-----------------------------------------------
+void uso(const char * prog) {
+  cerr << "uso: " << prog << " [-f fumadores] [-w hebras] [-d segundos] [-n cigarros] [-q]" << endl
+       << "   -w    : hebras que ejecutan las corrutinas (por defecto, una por procesador)" << endl
+       << "   -d, -n: terminar tras ese tiempo o ese número de cigarros, e informar" << endl
+       << "   -q    : modo de carga, sin esperas ni mensajes (5 segundos si no hay -d ni -n)" << endl;
+  exit(1);
+}
+
+void leerOpciones(int argc, char const *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const string opt = argv[i];
+    if (opt == "-q")
+      sin_salida = true;
+    else {
+      if (i+1 >= argc)
+        uso(argv[0]);
+      const char * val = argv[++i];
+      if (opt == "-f")
+        num_fumadores = atoi(val);
+      else if (opt == "-w")
+        num_hebras = unsigned(atoi(val));
+      else if (opt == "-d")
+        duracion = atof(val);
+      else if (opt == "-n")
+        objetivo = strtoul(val, nullptr, 10);
+      else
+        uso(argv[0]);
+    }
+  }
+  if (num_fumadores < 1 || duracion < 0)
+    uso(argv[0]);
+  if (sin_salida && duracion == 0 && objetivo == 0)
+    duracion = 5;
+  if (num_hebras == 0)
+    num_hebras = max(1u, thread::hardware_concurrency());
+}
+
+//Programa principal------------------------------------------------------------
+
+int main(int argc, char const *argv[]) {
+  leerOpciones(argc, argv);
+
+  mensaje() << "--------------------------------------" << endl
+       << "Problema de los fumadores (corrutinas)." << endl
+       << "--------------------------------------";
+
+  CoPool pool(num_hebras);
+  Estanco estanco;
+
+  pool.spawn(estanquero(estanco));
+  for (int i = 0; i < num_fumadores; i++) {
+    pool.spawn(fumador(estanco, i));
+  }
+  if (duracion > 0 || objetivo > 0)
+    pool.spawn(cronometro(estanco));      //Sin límites el programa no termina nunca
+
+  pool.run();                             //Hasta que terminan todas las corrutinas
+
+  AsyncLog::instance().flush();           //Los mensajes pendientes, antes del informe
+  estanco.informe();
+
+  struct rusage uso_recursos;
+  getrusage(RUSAGE_SELF, &uso_recursos);
+  cout << "Hebras: " << num_hebras << ", memoria máxima: "
+       << uso_recursos.ru_maxrss / 1024 << " MiB" << endl;
+  return 0;
+}
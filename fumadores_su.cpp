@@ -3,138 +3,369 @@
 #include <random>
 #include <chrono>
 #include <mutex>
+#include <vector>
+#include <string>
+#include <cstdlib>
 #include "HoareMonitor.hpp"
+#include "AsyncLog.hpp"
 
 using namespace HM;
 
-//Variables globales------------------------------------------------------------
-constexpr int
-  num_fumadores = 3;           // número de fumadores
-mutex
-  mtx ;                        // mutex de escritura en pantalla
+//Variables globales (configurables desde la línea de órdenes, ver 'uso')------
+int
+  num_fumadores = 3,           // número de fumadores
+  tamanio_mostrador = 1,       // huecos del mostrador
+  tamanio_lote = 1;            // ingredientes que pone el estanquero en cada entrada al monitor
+double
+  duracion = 0;                // segundos hasta terminar (0: sin límite)
+unsigned long
+  objetivo = 0;                // cigarros fumados hasta terminar (0: sin límite)
+long
+  semilla = -1;                // semilla de los generadores aleatorios (-1: aleatoria)
+bool
+  sin_salida = false,          // modo de carga: sin esperas ni mensajes
+  tiempo_virtual = false,      // simulación con tiempo virtual (ver VirtualTime)
+  estadisticas = false;        // escribir las estadísticas del monitor al terminar
 
-//Generador de números aleatorios-----------------------------------------------
-template< int min, int max > int aleatorio(){
-  static default_random_engine generador( (random_device())() );
-  static uniform_int_distribution<int> distribucion_uniforme( min, max ) ;
-  return distribucion_uniforme( generador );
+//Mensajes del programa (ninguno en el modo de carga: una línea nula)-----------
+inline LogLine mensaje(){
+  return async_log(!sin_salida);
+}
+
+//Semántica de los monitores: Hoare por defecto, Mesa con -DSEMANTICA_MESA------
+#ifdef SEMANTICA_MESA
+typedef SignalContinue Semantica;
+#else
+typedef SignalUrgentWait Semantica;
+#endif
+
+//Generador de números aleatorios (uno por hebra)-------------------------------
+// Con -r la semilla de cada hebra es fija: con tiempo virtual, la ejecución se repite
+unsigned semillaHebra(){
+  if (semilla < 0)
+    return (random_device())();
+  return unsigned(semilla) + ThreadIdentity::current().id();
+}
+
+int aleatorio(int min, int max){
+  static thread_local default_random_engine generador( semillaHebra() );
+  return uniform_int_distribution<int>( min, max )( generador );
+}
+
+//En el modo de carga no hay esperas, salvo con tiempo virtual (no cuestan nada)
+bool sinEsperas(){
+  return sin_salida && !tiempo_virtual;
 }
 
 //Produce un ingrediente entre 0 y (num_fumadores-1)----------------------------
 int producirIngrediente(){
-  int igr = aleatorio<0,num_fumadores-1>();
+  int igr = aleatorio(0, num_fumadores-1);
   return igr;
 }
 
+//Produce los ingredientes de un lote-------------------------------------------
+// (el mensaje se escribe aquí, fuera del monitor: ponerIngredientes no escribe)
+vector<int> producirLote(){
+  vector<int> lote(tamanio_lote);
+  for (auto & ing : lote)
+    ing = producirIngrediente();
+  if (!sin_salida) {
+    string ingredientes;
+    for (const int ing : lote)
+      ingredientes += " " + to_string(ing);
+    mensaje() << "Ingredientes producidos:" << ingredientes;
+  }
+  return lote;
+}
+
 void fumar(int num_fumador){
+  if (sinEsperas())
+    return;
+
   // calcular milisegundos aleatorios de duración de la acción de fumar)
-  chrono::milliseconds duracion_fumar( aleatorio<20,200>() );
+  chrono::milliseconds duracion_fumar( aleatorio(20, 200) );
 
   // informa de que comienza a fumar
-  mtx.lock();
-  cout << "Fumador" << num_fumador << ":"
+  mensaje() << "Fumador" << num_fumador << ":"
         << " empieza a fumar (" << duracion_fumar.count()
-          << " milisegundos)"
-            << endl;
-  mtx.unlock();
+          << " milisegundos)";
 
   // espera bloqueada un tiempo igual a ''duracion_fumar' milisegundos
-  this_thread::sleep_for( duracion_fumar );
+  VirtualTime::sleep_for( duracion_fumar );
 
   // informa de que ha terminado de fumar
-  mtx.lock();
-  cout << "Fumador" << num_fumador
-          << ": termina de fumar, comienza espera de ingrediente."
-            << endl;
-  mtx.unlock();
+  mensaje() << "Fumador" << num_fumador
+          << ": termina de fumar, comienza espera de ingrediente.";
 }
 
 //Monitor para regular la interaccion estanquero-fumador------------------------
-class Estanco : public HoareMonitor{
+// El número de fumadores se conoce al arrancar: colas de condición dinámicas
+// El mostrador es un anillo de huecos, en orden de llegada: el estanquero no
+// espera a que lo vacíen tras cada ingrediente, sino a tener sitio para un lote,
+// y el fumador se lleva el más antiguo de los suyos (ver obtenerIngrediente)
+class Estanco : public BasicMonitor<Semantica>{
 private:
-  int mostrador;                          //Mostrador vacio: -1; con ing_i = i
-  CondVar c_est, c_fum[num_fumadores];
+  vector<int> mostrador;                  //Anillo de tamanio_mostrador huecos
+  unsigned primero, ocupados;             //Hueco del ingrediente más antiguo y huecos ocupados
+  vector<unsigned> en_mostrador;          //Ingredientes de cada tipo en el mostrador
+  unsigned huecos_pedidos;                //Huecos que espera el estanquero (0: no espera)
+  CondVar c_est, c_fin;
+  vector<CondVar> c_fum;
+
+  bool terminado;                         //Fin de la ejecución: las hebras salen de sus bucles
+  unsigned long total_cigarros;
+  unsigned long ingredientes_puestos, lotes_puestos;
+  unsigned long esperas_estanquero;       //Veces que el estanquero encuentra el mostrador lleno
+  vector<unsigned long> cigarros;         //Cigarros de cada fumador
+  chrono::steady_clock::time_point inicio, fin;
+
+  void finalizar();
 
 public:
   Estanco ();
-  void ponerIngrediente(int i);
-  void esperarMostradorVacio();
-  void obtenerIngrediente(int i);
+  void ponerIngredientes(const vector<int> & lote);
+  bool esperarHuecos(unsigned n);
+  bool obtenerIngrediente(int i);
+
+  void terminar();
+  void esperarFin();
+  void informe();
 };
 
 //Implementación de los métodos del monitor-------------------------------------
 
 // Constructor
-Estanco::Estanco(){
-  mostrador = -1;
+Estanco::Estanco()
+: BasicMonitor<Semantica>("estanco") {
+  mostrador.assign(tamanio_mostrador, -1);
+  primero = ocupados = 0;
+  en_mostrador.assign(num_fumadores, 0);
+  huecos_pedidos = 0;
   c_est  = newCondVar();
   for (int i = 0; i < num_fumadores; i++) {
-    c_fum[i] = newCondVar();
+    c_fum.push_back(newCondVar());
   }
-}
+  c_fin  = newCondVar();
 
-void Estanco::ponerIngrediente(int i){
-  mostrador = i;
+  terminado = false;
+  total_cigarros = 0;
+  ingredientes_puestos = lotes_puestos = 0;
+  esperas_estanquero = 0;
+  cigarros.assign(num_fumadores, 0);
+  inicio = VirtualTime::now();
+}
 
-  mtx.lock();
-  std::cout << "Ingrediente en venta: " << i << endl;
-  mtx.unlock();
+// Pone el lote (tras esperarHuecos) y avisa a los fumadores de esos ingredientes
+void Estanco::ponerIngredientes(const vector<int> & lote){
+  for (const int i : lote) {
+    mostrador[(primero + ocupados) % mostrador.size()] = i;
+    ocupados++;
+    en_mostrador[i]++;
+  }
+  ingredientes_puestos += lote.size();
+  lotes_puestos++;
 
-  c_fum[i].signal();
+  for (size_t k = 0; k+1 < lote.size(); k++)
+    c_fum[lote[k]].signal();              //Cada fumador, solo por su ingrediente
+  c_fum[lote.back()].signal_and_leave();  //Última operación: no hace falta esperar en la cola urgente
 }
 
-void Estanco::esperarMostradorVacio(){
-  if (mostrador != -1) {
+bool Estanco::esperarHuecos(unsigned n){
+  if (mostrador.size() - ocupados < n && !terminado)
+    esperas_estanquero++;
+  huecos_pedidos = n;
+  while (mostrador.size() - ocupados < n && !terminado) { //'while' en lugar de 'if': válido también con Mesa
     c_est.wait();
   }
+  huecos_pedidos = 0;
+  return !terminado;
 }
 
-void Estanco::obtenerIngrediente(int i){
-  if (mostrador != i) {
+bool Estanco::obtenerIngrediente(int i){
+  while (en_mostrador[i] == 0 && !terminado) {
     c_fum[i].wait();
   }
-  std::cout << "Retirado ingrediente " << i << endl;
+  if (terminado)
+    return false;
+  defer([i]{ mensaje() << "Retirado ingrediente " << i; });   //Se escribe tras salir del monitor
+
+  // Quita el ingrediente i más antiguo: los anteriores avanzan un hueco
+  const size_t n = mostrador.size();
+  unsigned k = 0;
+  while (mostrador[(primero + k) % n] != i)
+    k++;
+  for (; k > 0; k--)
+    mostrador[(primero + k) % n] = mostrador[(primero + k - 1) % n];
+  mostrador[primero] = -1;
+  primero = (primero + 1) % n;
+  ocupados--;
+  en_mostrador[i]--;
 
-  mostrador = -1;
-  c_est.signal();
+  cigarros[i]++;
+  if (++total_cigarros == objetivo)
+    finalizar();                          //Antes del signal_and_leave, que ha de ser lo último
+
+  if (huecos_pedidos > 0 && n - ocupados >= huecos_pedidos)
+    c_est.signal_and_leave();             //Solo si el estanquero ya tiene sitio para su lote
+  return true;
+}
+
+// Marca el fin y despierta a todas las hebras bloqueadas en el monitor
+void Estanco::finalizar(){
+  if (terminado)
+    return;
+  terminado = true;
+  fin = VirtualTime::now();
+  c_est.signal_all();
+  for (auto & c : c_fum)
+    c.signal_all();
+  c_fin.signal_all();
+}
+
+void Estanco::terminar(){
+  finalizar();
+}
+
+// Espera hasta alcanzar el objetivo o hasta que se agote la duración
+void Estanco::esperarFin(){
+  if (duracion > 0) {
+    const auto limite = inicio + chrono::duration_cast<chrono::steady_clock::duration>(
+                                   chrono::duration<double>(duracion));
+    while (!terminado && c_fin.wait_until(limite))
+      ;
+  }
+  else {
+    while (!terminado)
+      c_fin.wait();
+  }
+  finalizar();
+}
+
+void Estanco::informe(){
+  const double segundos = chrono::duration<double>(fin - inicio).count();
+  cout << "Tiempo: " << fixed << setprecision(3) << segundos << " s" << endl
+       << "Cigarros: " << total_cigarros << " ("
+         << setprecision(1) << total_cigarros / segundos << " por segundo)" << endl
+       << "Ingredientes puestos por el estanquero: " << ingredientes_puestos
+         << " (" << lotes_puestos << " lotes)" << endl
+       << "Mostrador: " << mostrador.size() << " huecos, lleno al poner " << esperas_estanquero << " veces" << endl;
+  for (int i = 0; i < num_fumadores; i++)
+    cout << "  Fumador" << i << ": " << cigarros[i] << " cigarros" << endl;
 }
 
 //Funciones que realizan el trabajo de estanquero y fumadores-------------------
 
 void hebra_estanquero(MRef<Estanco> estanco) {
-  int ing;
+  ThreadIdentity::current().set_name("Estanquero");
+  // Esperar sitio en el mostrador y poner el lote, en una sola entrada al
+  // monitor, hecha por su hebra ejecutora: mientras tanto se produce el siguiente
+  auto poner = [&estanco](const vector<int> & lote) {
+    return estanco.async([lote](Estanco & e) {
+      if (!e.esperarHuecos(lote.size()))
+        return false;
+      e.ponerIngredientes(lote);
+      return true;
+    });
+  };
+  MonitorFuture<bool> puesto = poner(producirLote());
   while (true) {
-    ing = producirIngrediente();
-    estanco->esperarMostradorVacio();
-    estanco->ponerIngrediente(ing);
+    const vector<int> lote = producirLote();
+    if (!puesto.get())
+      break;
+    puesto = poner(lote);
   }
 }
 
 void hebra_fumadora(MRef<Estanco> estanco, int i) {
-  while (true) {
-    estanco->obtenerIngrediente(i);
+  ThreadIdentity::current().set_name("Fumador " + to_string(i));
+  while (estanco->obtenerIngrediente(i)) {
     fumar(i);
   }
 }
 
+//Opciones de la línea de órdenes-----------------------------------------------
+void uso(const char * prog) {
+  cerr << "uso: " << prog << " [-f fumadores] [-s huecos] [-l lote] [-d segundos] [-n cigarros] [-q] [-v] [-r semilla] [-e]" << endl
+       << "   -s, -l: huecos del mostrador e ingredientes que pone el estanquero cada vez (1 y 1)" << endl
+       << "   -d, -n: terminar tras ese tiempo o ese número de cigarros, e informar" << endl
+       << "   -q    : modo de carga, sin esperas ni mensajes (5 segundos si no hay -d ni -n)" << endl
+       << "   -v    : tiempo virtual: las esperas no duran nada, y con -r la ejecución se repite" << endl
+       << "   -e    : escribir las estadísticas del monitor al terminar" << endl;
+  exit(1);
+}
+
+void leerOpciones(int argc, char const *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const string opt = argv[i];
+    if (opt == "-q")
+      sin_salida = true;
+    else if (opt == "-v")
+      tiempo_virtual = true;
+    else if (opt == "-e")
+      estadisticas = true;
+    else {
+      if (i+1 >= argc)
+        uso(argv[0]);
+      const char * val = argv[++i];
+      if (opt == "-f")
+        num_fumadores = atoi(val);
+      else if (opt == "-s")
+        tamanio_mostrador = atoi(val);
+      else if (opt == "-l")
+        tamanio_lote = atoi(val);
+      else if (opt == "-d")
+        duracion = atof(val);
+      else if (opt == "-r")
+        semilla = atol(val);
+      else if (opt == "-n")
+        objetivo = strtoul(val, nullptr, 10);
+      else
+        uso(argv[0]);
+    }
+  }
+  if (num_fumadores < 1 || tamanio_mostrador < 1 || tamanio_lote < 1
+      || tamanio_lote > tamanio_mostrador || duracion < 0)
+    uso(argv[0]);
+  if (sin_salida && duracion == 0 && objetivo == 0)
+    duracion = 5;
+}
+
 //Programa principal------------------------------------------------------------
 
 int main(int argc, char const *argv[]) {
-  cout << "--------------------------" << endl
+  leerOpciones(argc, argv);
+  const auto inicio_real = chrono::steady_clock::now();
+  if (tiempo_virtual)
+    VirtualTime::start();                 //Antes de crear el monitor y las hebras
+
+  mensaje() << "--------------------------" << endl
        << "Problema de los fumadores." << endl
-       << "--------------------------" << endl;
+       << "--------------------------";
 
   auto estanco = Create<Estanco>();
+  estanco->set_stats_enabled(estadisticas);
 
-  thread estanquero(hebra_estanquero, estanco);
-  thread fumadores[num_fumadores];
-  for (size_t i = 0; i < num_fumadores; i++) {
-    fumadores[i] = thread(hebra_fumadora, estanco, i);
+  thread estanquero = VirtualTime::spawn(hebra_estanquero, estanco);
+  vector<thread> fumadores;
+  for (int i = 0; i < num_fumadores; i++) {
+    fumadores.push_back(VirtualTime::spawn(hebra_fumadora, estanco, i));
   }
 
+  if (duracion > 0 || objetivo > 0)
+    estanco->esperarFin();                //Sin límites el programa no termina nunca
+  VirtualTime::leave();                   //Con tiempo virtual, las demás hebras siguen sin esta
+
   estanquero.join();
-  for (size_t i = 0; i < num_fumadores; i++) {
-    fumadores[i].join();
+  for (auto & f : fumadores) {
+    f.join();
   }
+
+  const double segundos_reales = chrono::duration<double>(chrono::steady_clock::now() - inicio_real).count();
+  AsyncLog::instance().flush();           //Los mensajes pendientes, antes del informe
+  estanco->informe();
+  if (tiempo_virtual)
+    cout << "Tiempo real: " << fixed << setprecision(3) << segundos_reales << " s" << endl;
+  if (estadisticas)
+    estanco->print_stats(cout);
   return 0;
 }
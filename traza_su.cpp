@@ -0,0 +1,263 @@
+// *****************************************************************************
+//
+// Monitor events trace dumper
+//
+// Reads a trace file written by a program compiled with TRAZA_M (see
+// "Monitor events trace" in HoareMonitor.hpp), merges the records of all the
+// threads in time order and writes them:
+//
+//   as a text timeline (default): one line per event, with the time in
+//   microseconds since the first event, thread, monitor and event
+//
+//   as Chrome/Perfetto trace JSON (option -j): one track per thread, with
+//   spans for the time waiting to enter, running in each monitor, waiting on
+//   condition variables and waiting in the urgent queue, and instant events
+//   for the signals (open with chrome://tracing or https://ui.perfetto.dev)
+//
+// usage: traza_su [-j] [trace_file]     (default trace file: traza_m.bin)
+//
+// *****************************************************************************
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "HoareMonitor.hpp"
+
+using namespace HM ;
+using namespace std ;
+
+// a record of the trace, with the thread which recorded it
+
+struct Evento
+{
+   TraceRecord reg ;
+   uint32_t    hebra ;
+} ;
+
+// contents of a trace file
+
+struct Traza
+{
+   double                   ns_por_tick ;
+   map<uint32_t,string>     monitores ;   // monitor identifier -> name
+   map<uint32_t,string>     hebras ;      // thread number -> name
+   vector<Evento>           eventos ;     // all the records, in time order
+} ;
+
+// *****************************************************************************
+// read a trace file, returns false if it is not a valid trace
+
+bool leer( const string & nombre, Traza & t )
+{
+   ifstream f( nombre, ios::binary );
+   if ( ! f )
+   {
+      cerr << "no se puede abrir el archivo '" << nombre << "'" << endl ;
+      return false ;
+   }
+
+   TraceFileHeader cab ;
+   if ( ! f.read( reinterpret_cast<char *>( &cab ), sizeof( cab ) )
+        || memcmp( cab.magic, trace_magic, sizeof( cab.magic ) ) != 0 )
+   {
+      cerr << "'" << nombre << "' no es un archivo de traza de monitores" << endl ;
+      return false ;
+   }
+   t.ns_por_tick = cab.ns_per_tick ;
+
+   for( uint32_t i = 0 ; i < cab.num_monitors ; i++ )
+   {
+      TraceMonitorEntry m ;
+      if ( ! f.read( reinterpret_cast<char *>( &m ), sizeof( m ) ) )
+         return false ;
+      m.name[trace_name_size-1] = 0 ;
+      t.monitores[m.monitor] = m.name ;
+   }
+
+   for( uint32_t i = 0 ; i < cab.num_threads ; i++ )
+   {
+      TraceThreadEntry h ;
+      if ( ! f.read( reinterpret_cast<char *>( &h ), sizeof( h ) ) )
+         return false ;
+      h.name[trace_name_size-1] = 0 ;
+      t.hebras[h.thread] = h.name ;
+
+      vector<TraceRecord> regs( h.num_records );
+      if ( ! f.read( reinterpret_cast<char *>( regs.data() ), streamsize( regs.size()*sizeof( TraceRecord ) ) ) )
+         return false ;
+      for( auto & r : regs )
+         t.eventos.push_back( Evento{ r, h.thread } );
+   }
+
+   stable_sort( t.eventos.begin(), t.eventos.end(),
+      []( const Evento & a, const Evento & b ) { return a.reg.ticks < b.reg.ticks ; } );
+   return true ;
+}
+// -----------------------------------------------------------------------------
+
+string nombre_monitor( const Traza & t, uint32_t id )
+{
+   const auto it = t.monitores.find( id );
+   return it != t.monitores.end() ? it->second : "monitor " + to_string( id ) ;
+}
+// -----------------------------------------------------------------------------
+// time of an event in microseconds since the first event
+
+double tiempo_us( const Traza & t, const Evento & e )
+{
+   return double( e.reg.ticks - t.eventos.front().reg.ticks )*t.ns_por_tick/1000.0 ;
+}
+
+// *****************************************************************************
+// text timeline
+
+void escribir_texto( const Traza & t )
+{
+   char linea[256] ;
+   for( auto & e : t.eventos )
+   {
+      const TraceRecord & r = e.reg ;
+      string detalle ;
+
+      if ( r.kind == trace_wait || r.kind == trace_resume || r.kind == trace_timeout )
+         detalle = "cond " + to_string( r.cond );
+      else if ( r.kind == trace_signal )
+         detalle = "cond " + to_string( r.cond ) + " (" + to_string( r.arg ) + " despertadas)" ;
+      else if ( r.kind == trace_enter && r.arg != 0 )
+         detalle = "(tras esperar)" ;
+
+      snprintf( linea, sizeof( linea ), "%14.3f us  %-20s %-16s %-14s %s",
+                tiempo_us( t, e ), t.hebras.at( e.hebra ).c_str(),
+                nombre_monitor( t, r.monitor ).c_str(), trace_kind_name( r.kind ),
+                detalle.c_str() );
+      string texto( linea );
+      texto.erase( texto.find_last_not_of( ' ' )+1 );
+      cout << texto << '\n' ;
+   }
+}
+
+// *****************************************************************************
+// Chrome/Perfetto trace JSON
+
+string json_texto( const string & s )
+{
+   string r = "\"" ;
+   for( char c : s )
+   {
+      if ( c == '"' || c == '\\' )
+         r += '\\' ;
+      r += c ;
+   }
+   return r + "\"" ;
+}
+// -----------------------------------------------------------------------------
+// write an event ('ph' is the Chrome trace event phase: B, E, i or M)
+
+void json_evento( bool & primero, const char * ph, const string & nombre,
+                  uint32_t hebra, double ts, const string & args = "" )
+{
+   cout << ( primero ? "\n" : ",\n" )
+        << "{\"name\":" << json_texto( nombre ) << ",\"ph\":\"" << ph << "\""
+        << ",\"pid\":1,\"tid\":" << hebra << ",\"ts\":" << ts ;
+   if ( *ph == 'i' )
+      cout << ",\"s\":\"t\"" ;
+   if ( args != "" )
+      cout << ",\"args\":{" << args << "}" ;
+   cout << "}" ;
+   primero = false ;
+}
+// -----------------------------------------------------------------------------
+
+void escribir_json( const Traza & t )
+{
+   bool primero = true ;
+   cout.precision( 3 );
+   cout << fixed << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" ;
+
+   for( auto & h : t.hebras )
+      json_evento( primero, "M", "thread_name", h.first, 0,
+                   "\"name\":" + json_texto( h.second ) );
+
+   for( auto & e : t.eventos )
+   {
+      const TraceRecord & r    = e.reg ;
+      const double        ts   = tiempo_us( t, e );
+      const string        mon  = nombre_monitor( t, r.monitor ),
+                          cond = mon + " cond " + to_string( r.cond );
+
+      switch( r.kind )
+      {
+         case trace_enter_request :
+            json_evento( primero, "B", "espera " + mon, e.hebra, ts );
+            break ;
+         case trace_enter :
+            if ( r.arg != 0 )
+               json_evento( primero, "E", "espera " + mon, e.hebra, ts );
+            json_evento( primero, "B", mon, e.hebra, ts );
+            break ;
+         case trace_leave :
+            json_evento( primero, "E", mon, e.hebra, ts );
+            break ;
+         case trace_wait :
+            json_evento( primero, "B", "wait " + cond, e.hebra, ts );
+            break ;
+         case trace_resume :
+         case trace_timeout :
+            json_evento( primero, "E", "wait " + cond, e.hebra, ts,
+                         r.kind == trace_timeout ? "\"timeout\":true" : "" );
+            break ;
+         case trace_signal :
+            json_evento( primero, "i", "signal " + cond, e.hebra, ts,
+                         "\"despertadas\":" + to_string( r.arg ) );
+            break ;
+         case trace_urgent :
+            json_evento( primero, "B", "urgente " + mon, e.hebra, ts );
+            break ;
+         case trace_urgent_resume :
+            json_evento( primero, "E", "urgente " + mon, e.hebra, ts );
+            break ;
+      }
+   }
+   cout << "\n]}" << endl ;
+}
+
+// *****************************************************************************
+
+int main( int argc, char * argv[] )
+{
+   bool   json   = false ;
+   string nombre = "traza_m.bin" ;
+
+   for( int i = 1 ; i < argc ; i++ )
+   {
+      if ( string( argv[i] ) == "-j" )
+         json = true ;
+      else if ( argv[i][0] == '-' )
+      {
+         cerr << "uso: " << argv[0] << " [-j] [archivo_traza]" << endl ;
+         return 1 ;
+      }
+      else
+         nombre = argv[i] ;
+   }
+
+   Traza t ;
+   if ( ! leer( nombre, t ) )
+      return 1 ;
+   if ( t.eventos.empty() )
+   {
+      cerr << "la traza no tiene eventos" << endl ;
+      return 0 ;
+   }
+
+   if ( json )
+      escribir_json( t );
+   else
+      escribir_texto( t );
+   return 0 ;
+}